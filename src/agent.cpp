@@ -3,37 +3,110 @@
 #include <cassert>
 #include <cmath>
 
+#include "ngram.hpp"
 #include "predict.hpp"
 #include "search.hpp"
 #include "util.hpp"
 
 
+// construct a model of the given kind ("ctw" or "ngram") from the options
+static Model *createModel(const std::string &kind, options_t &options) {
+	if (kind == "ngram") {
+		return new NGramModel(strExtract<size_t>(options["ngram-order"]),
+			strExtract<unsigned int>(options["ngram-table-bits"]));
+	}
+	if (kind != "ctw") {
+		std::cerr << "WARNING: unknown model '" << kind << "', using ctw" << std::endl;
+	}
+	ContextTree *ct = new ContextTree(strExtract<unsigned int>(options["ct-depth"]));
+	ct->setRolloutDepth(strExtract<size_t>(options["rollout-ct-depth"]));
+	return ct;
+}
+
+
 // construct a learning agent from the command line arguments
 Agent::Agent(options_t & options) {
-	std::string s;
+	init(options);
+
+	m_model = createModel(options["model"], options);
+	m_rollout_model = NULL;
+	if (options["rollout-model"] != "" && options["rollout-model"] != options["model"]) {
+		m_rollout_model = createModel(options["rollout-model"], options);
+	}
+
+	reset();
+}
+
+
+// construct a learning agent around an already allocated context tree
+Agent::Agent(options_t & options, ContextTree *ct) {
+	init(options);
+
+	m_model = ct;
+	ct->setRolloutDepth(strExtract<size_t>(options["rollout-ct-depth"]));
+	m_rollout_model = NULL;
+	if (options["rollout-model"] != "" && options["rollout-model"] != "ctw") {
+		m_rollout_model = createModel(options["rollout-model"], options);
+	}
+
+	reset();
+}
+
+
+// fork an agent, sharing the nodes of its context tree
+Agent::Agent(const Agent &other) :
+	m_last_update_percept(other.m_last_update_percept),
+	m_total_reward(other.m_total_reward),
+	m_time_cycle(other.m_time_cycle),
+	m_actions(other.m_actions),
+	m_actions_bits(other.m_actions_bits),
+	m_obs_bits(other.m_obs_bits),
+	m_rew_bits(other.m_rew_bits),
+	m_percepts(other.m_percepts),
+	m_horizon(other.m_horizon),
+	m_model(other.m_model->fork()),
+	m_rollout_model(other.m_rollout_model ? other.m_rollout_model->fork() : NULL),
+	m_in_rollout(other.m_in_rollout),
+	m_lazy(false),
+	m_cursor(0),
+	m_journal_base(0),
+	m_rollout_journal_base(0) {
+
+	// the models of the other agent must be in its state
+	assert(other.m_cursor == other.m_journal.size());
+}
+
 
+// read the agent properties from the options
+void Agent::init(options_t & options) {
 	strExtract(options["agent-actions"], m_actions);
 	strExtract(options["agent-horizon"], m_horizon);
 	strExtract(options["observation-bits"], m_obs_bits);
 	strExtract<unsigned int>(options["reward-bits"], m_rew_bits);
 
 	// calculate the number of bits needed to represent the action
-	for (unsigned int i = 1, c = 1; i < m_actions; i *= 2, c++) {
-		m_actions_bits = c;
-	}
-	
+	m_actions_bits = bitsRequired(m_actions);
+
 	// calculate the number of possible percepts
 	m_percepts = pow(2, m_obs_bits + m_rew_bits);
 
-	m_ct = new ContextTree(strExtract<unsigned int>(options["ct-depth"]));
-
-	reset();
+	m_lazy = false;
+	m_cursor = 0;
+	m_journal_base = 0;
+	m_rollout_journal_base = 0;
 }
 
 
 // destruct the agent and the corresponding context tree
 Agent::~Agent(void) {
-	if (m_ct) delete m_ct;
+	if (m_model) delete m_model;
+	if (m_rollout_model) delete m_rollout_model;
+}
+
+
+// create an independent copy of the agent
+Agent *Agent::fork(void) const {
+	return new Agent(*this);
 }
 
 
@@ -92,7 +165,21 @@ unsigned int Agent::numRewBits(void) const {
 
 // the length of the stored history for an agent
 size_t Agent::historySize(void) const {
-	return m_ct->historySize();
+	return m_lazy ? m_journal_base + m_cursor : m_model->historySize();
+}
+
+
+// the length of the history of the rollout model
+size_t Agent::rolloutHistorySize(void) const {
+	if (!m_lazy) return rolloutModel()->historySize();
+	return m_rollout_model ? m_rollout_journal_base + m_cursor : historySize();
+}
+
+
+// a hash of the context of the agent's model
+uint64_t Agent::contextHash(void) {
+	syncModel();
+	return m_model->contextHash();
 }
 
 
@@ -113,7 +200,7 @@ action_t Agent::genRandomAction(void) const {
 action_t Agent::genAction(void) const {
     assert(!m_last_update_percept); 
     symbol_list_t action_symbols;
-	m_ct->genRandomSymbols(action_symbols, m_actions_bits);
+	m_model->genRandomSymbols(action_symbols, m_actions_bits);
     return decodeAction(action_symbols); 
 }
 
@@ -124,18 +211,128 @@ void Agent::genPerceptAndUpdate(percept_t &obs, percept_t &rew) {
     assert(m_last_update_percept == false);
     symbol_list_t obs_symbols, rew_symbols;
     
-    //generate obs and reward symbols
-    m_ct->genRandomSymbolsAndUpdate(obs_symbols, m_obs_bits);
-    m_ct->genRandomSymbolsAndUpdate(rew_symbols, m_rew_bits);
+    //generate obs and reward symbols from the model being sampled
+    if (m_lazy && !m_in_rollout) {
+        for (unsigned int i = 0; i < m_obs_bits; i++) obs_symbols.push_back(lazySample());
+        for (unsigned int i = 0; i < m_rew_bits; i++) rew_symbols.push_back(lazySample());
+        rew = decodeReward(rew_symbols);
+        obs = decodeObservation(obs_symbols);
+        m_last_update_percept = true;
+        m_total_reward += rew;
+        return;
+    }
+    if (m_in_rollout) {
+        rolloutModel()->genRolloutSymbols(obs_symbols, m_obs_bits);
+        rolloutModel()->genRolloutSymbols(rew_symbols, m_rew_bits);
+    } else {
+        m_model->genRandomSymbolsAndUpdate(obs_symbols, m_obs_bits);
+        m_model->genRandomSymbolsAndUpdate(rew_symbols, m_rew_bits);
+    }
 
     rew = decodeReward(rew_symbols);
     obs = decodeObservation(obs_symbols);
 
+    // keep the other model in step outside of rollouts
+    if (!m_in_rollout && m_rollout_model) {
+        m_rollout_model->update(obs_symbols);
+        m_rollout_model->update(rew_symbols);
+    }
+
     // Update other properties
     m_last_update_percept=true;
     m_total_reward += rew;
 }
 
+// generate a percept bit by bit, drawing each bit from the probability kept
+// in the cache, if any, and keeping the model's probability otherwise
+void Agent::genPerceptAndUpdate(percept_t &obs, percept_t &rew,
+		PerceptCache &cache) {
+    assert(m_last_update_percept == false);
+    assert(!m_in_rollout);
+    symbol_list_t obs_symbols, rew_symbols;
+
+    for (unsigned int i = 0; i < m_obs_bits + m_rew_bits; i++) {
+        double prob_zero = cache.probZero();
+        symbol_t sym = sampleSymbol(prob_zero);
+        cache.next(sym, prob_zero);
+        (i < m_obs_bits ? obs_symbols : rew_symbols).push_back(sym);
+    }
+
+    rew = decodeReward(rew_symbols);
+    obs = decodeObservation(obs_symbols);
+    m_last_update_percept = true;
+    m_total_reward += rew;
+}
+
+
+// A depth-first walk over the percept symbols, in order of probability,
+// keeping the n most probable complete percepts in 'best'. A prefix no
+// more probable than the n'th best percept so far cannot lead to a better
+// one, and is skipped. At most 'budget' prefixes are extended.
+typedef std::pair<double, symbol_list_t> scored_percept_t;
+
+static void probableSymbols(Model &model, symbol_list_t &prefix, size_t bits,
+		double prob, size_t n, std::vector<scored_percept_t> &best,
+		size_t &budget) {
+	if (prefix.size() == bits) {
+		std::vector<scored_percept_t>::iterator it = best.begin();
+		while (it != best.end() && it->first >= prob) ++it;
+		best.insert(it, scored_percept_t(prob, prefix));
+		if (best.size() > n) best.pop_back();
+		return;
+	}
+
+	double prob_one = model.predict(true);
+	symbol_t first = prob_one > 0.5;
+	for (int i = 0; i < 2; i++) {
+		symbol_t sym = i == 0 ? first : !first;
+		double p = prob * (sym ? prob_one : 1.0 - prob_one);
+		if (best.size() == n && p <= best.back().first) continue;
+		if (budget == 0) return;
+		budget--;
+
+		model.update(sym);
+		prefix.push_back(sym);
+		probableSymbols(model, prefix, bits, p, n, best, budget);
+		prefix.pop_back();
+		model.revert();
+	}
+}
+
+
+// the n most probable next percepts under the agent's model
+void Agent::probablePercepts(size_t n, std::vector<percept_t> &observations,
+		std::vector<percept_t> &rewards) {
+	assert(m_last_update_percept == false);
+	observations.clear();
+	rewards.clear();
+	if (n == 0) return;
+
+	std::vector<scored_percept_t> best;
+	symbol_list_t prefix;
+	size_t budget = 64 * n * (m_obs_bits + m_rew_bits);
+	probableSymbols(*m_model, prefix, m_obs_bits + m_rew_bits, 1.0, n, best,
+		budget);
+
+	for (size_t i = 0; i < best.size(); i++) {
+		symbol_list_t obs_symbols(best[i].second.begin(),
+			best[i].second.begin() + m_obs_bits);
+		observations.push_back(decodeObservation(obs_symbols));
+		rewards.push_back(decodeReward(best[i].second));
+	}
+}
+
+
+// the probability of the next percept under the agent's model, which is left
+// as it was found
+double Agent::perceptProbability(percept_t observation, percept_t reward) {
+	assert(m_last_update_percept == false);
+	symbol_list_t percept;
+	encodePercept(percept, observation, reward);
+	return m_model->predict(percept);
+}
+
+
 // Update the agent's internal model of the world after receiving a percept
 void Agent::modelUpdate(percept_t observation, percept_t reward) {
     assert(m_last_update_percept == false);
@@ -144,7 +341,12 @@ void Agent::modelUpdate(percept_t observation, percept_t reward) {
 	symbol_list_t percept;
 	encodePercept(percept, observation, reward);
 
-	m_ct->update(percept);
+	if (m_lazy && !m_in_rollout) {
+		for (size_t i = 0; i < percept.size(); i++) lazyUpdate(percept[i], true);
+	} else {
+		if (!m_in_rollout || !m_rollout_model) m_model->update(percept);
+		if (m_rollout_model) m_rollout_model->update(percept);
+	}
 
 	// Update other properties
 	m_total_reward += reward;
@@ -161,7 +363,12 @@ void Agent::modelUpdate(action_t action) {
 	symbol_list_t action_syms;
 	encodeAction(action_syms, action);
 	
-	m_ct->updateHistory(action_syms);
+	if (m_lazy && !m_in_rollout) {
+		for (size_t i = 0; i < action_syms.size(); i++) lazyUpdate(action_syms[i], false);
+	} else {
+		if (!m_in_rollout || !m_rollout_model) m_model->updateHistory(action_syms);
+		if (m_rollout_model) m_rollout_model->updateHistory(action_syms);
+	}
 
 	m_time_cycle++;
 	m_last_update_percept = false;
@@ -173,18 +380,23 @@ void Agent::modelUpdate(action_t action) {
 bool Agent::modelRevert(const ModelUndo &mu) {
     if(m_time_cycle < mu.age())
         return false;
+
+    // move back along the kept symbols, if the save point is among them
+    if (m_lazy && !m_in_rollout && mu.historySize() >= m_journal_base) {
+        assert(mu.historySize() <= m_journal_base + m_cursor);
+        m_cursor = mu.historySize() - m_journal_base;
+        m_last_update_percept = mu.lastUpdatePercept();
+        m_time_cycle = mu.age();
+        m_total_reward = mu.reward();
+        return true;
+    }
+    syncModel();
     
     //go back in history and revert actions and percepts as appropriate
-    while(historySize() > mu.historySize()){
-        if(m_last_update_percept){
-            m_ct->revert(m_rew_bits + m_obs_bits);
-            m_last_update_percept = false;
-        }
-        else{
-            m_ct->revertHistory(m_actions_bits);
-            m_last_update_percept = true;
-        }
+    if (m_rollout_model) {
+        revertModel(*m_rollout_model, mu.rolloutHistorySize(), m_last_update_percept, false);
     }
+    m_last_update_percept = revertModel(*m_model, mu.historySize(), m_last_update_percept, false);
 
     m_time_cycle = mu.age();
     m_total_reward = mu.reward();
@@ -193,8 +405,161 @@ bool Agent::modelRevert(const ModelUndo &mu) {
 }
 
 
+// sample percepts from the rollout model until endRollout()
+void Agent::beginRollout(void) {
+    assert(!m_in_rollout);
+    syncModel();
+    m_in_rollout = true;
+}
+
+
+// stop sampling from the rollout model, reverting it to a previous state
+void Agent::endRollout(const ModelUndo &mu) {
+    assert(m_in_rollout);
+
+    if (m_rollout_model) {
+        // the main model was not touched during the rollout
+        revertModel(*m_rollout_model, mu.rolloutHistorySize(), m_last_update_percept, true);
+        m_last_update_percept = mu.lastUpdatePercept();
+    } else {
+        m_last_update_percept = revertModel(*m_model, mu.historySize(), m_last_update_percept, true);
+    }
+    m_in_rollout = false;
+
+    m_time_cycle = mu.age();
+    m_total_reward = mu.reward();
+}
+
+
+// start reverting lazily from the agent's current state
+void Agent::beginLazyRevert(void) {
+    assert(!m_in_rollout);
+    m_lazy = true;
+    m_journal.clear();
+    m_cursor = 0;
+    m_journal_base = m_model->historySize();
+    m_rollout_journal_base = m_rollout_model ? m_rollout_model->historySize() : 0;
+}
+
+
+// revert the models to the agent's state, and stop reverting lazily
+void Agent::endLazyRevert(void) {
+    syncModel();
+    m_lazy = false;
+}
+
+
+// revert the kept symbols the agent has moved back past
+void Agent::syncModel(void) {
+    while (m_journal.size() > m_cursor) {
+        if (m_journal.back().learned) {
+            m_model->revert();
+            if (m_rollout_model) m_rollout_model->revert();
+        } else {
+            m_model->revertHistory(1);
+            if (m_rollout_model) m_rollout_model->revertHistory(1);
+        }
+        m_journal.pop_back();
+    }
+}
+
+
+// update the models with a symbol unless it is the next kept symbol
+void Agent::lazyUpdate(symbol_t sym, bool learned) {
+    if (m_cursor < m_journal.size() && m_journal[m_cursor].symbol == sym) {
+        m_cursor++;
+        return;
+    }
+    syncModel();
+    if (learned) {
+        m_model->update(sym);
+        if (m_rollout_model) m_rollout_model->update(sym);
+    } else {
+        m_model->updateHistory(sym);
+        if (m_rollout_model) m_rollout_model->updateHistory(sym);
+    }
+    journal_entry_t entry = { sym, learned, -1.0 };
+    m_journal.push_back(entry);
+    m_cursor++;
+}
+
+
+// Generate a percept symbol. The next kept symbol, if sampled, gives the
+// model's probability of a 0 in this state, so the symbol can be drawn
+// without the model, which is only touched if the draw differs.
+symbol_t Agent::lazySample(double &prob_zero) {
+    journal_entry_t entry = { false, true, -1.0 };
+    if (prob_zero < 0.0 && m_cursor < m_journal.size()) {
+        prob_zero = m_journal[m_cursor].prob_zero;
+    }
+    if (prob_zero >= 0.0) {
+        symbol_t sym = rand01() > prob_zero;
+        if (m_cursor < m_journal.size() && sym == m_journal[m_cursor].symbol) {
+            m_cursor++;
+            return sym;
+        }
+        entry.symbol = sym;
+        entry.prob_zero = prob_zero;
+        syncModel();
+        m_model->update(sym);
+    } else {
+        syncModel();
+        entry.symbol = m_model->genRandomSymbolAndUpdate(entry.prob_zero);
+        prob_zero = entry.prob_zero;
+    }
+    if (m_rollout_model) m_rollout_model->update(entry.symbol);
+    m_journal.push_back(entry);
+    m_cursor++;
+    return entry.symbol;
+}
+
+
+// Generate a percept symbol with a given probability of a 0, or with the
+// model's, and update the models with it
+symbol_t Agent::sampleSymbol(double &prob_zero) {
+    if (m_lazy) return lazySample(prob_zero);
+
+    symbol_t sym;
+    if (prob_zero >= 0.0) {
+        sym = rand01() > prob_zero;
+        m_model->update(sym);
+    } else {
+        sym = m_model->genRandomSymbolAndUpdate(prob_zero);
+    }
+    if (m_rollout_model) m_rollout_model->update(sym);
+    return sym;
+}
+
+
+// revert a model to a previous history size. Percepts were learned by the
+// model while actions were only added to its history, so the two are undone
+// alternately starting from the most recent update. Rollout percepts are
+// undone with revertRollout(). Returns whether the last remaining update is
+// a percept.
+bool Agent::revertModel(Model &model, size_t history_size,
+		bool last_update_percept, bool rollout) const {
+    while(model.historySize() > history_size){
+        if(last_update_percept && rollout){
+            model.revertRollout(m_rew_bits + m_obs_bits);
+            last_update_percept = false;
+        }
+        else if(last_update_percept){
+            model.revert(m_rew_bits + m_obs_bits);
+            last_update_percept = false;
+        }
+        else{
+            model.revertHistory(m_actions_bits);
+            last_update_percept = true;
+        }
+    }
+    return last_update_percept;
+}
+
+
 void Agent::reset(void) {
-	m_ct->clear();
+	m_model->clear();
+	if (m_rollout_model) m_rollout_model->clear();
+	m_in_rollout = false;
 
 	m_time_cycle = 0;
 	m_total_reward = 0.0;
@@ -244,12 +609,16 @@ percept_t Agent::decodeObservation(const symbol_list_t &symlist) const {
     return decode(symlist, m_obs_bits);
 }
 
-void Agent::loadCT(std::istream &in){
-    in >> (*m_ct);
+// load the agent's model(s) from a stream written by writeModel()
+void Agent::loadModel(std::istream &in){
+    m_model->read(in);
+    if (m_rollout_model) m_rollout_model->read(in);
 }
 
-void Agent::writeCT(std::ostream &out){
-   out << (*m_ct);
+// write the agent's model, followed by its rollout model if it has one
+void Agent::writeModel(std::ostream &out){
+   m_model->write(out);
+   if (m_rollout_model) m_rollout_model->write(out);
 }
 
 
@@ -258,5 +627,6 @@ ModelUndo::ModelUndo(const Agent &agent) {
     m_age          = agent.age();
     m_reward       = agent.reward();
     m_history_size = agent.historySize();
+    m_rollout_history_size = agent.rolloutHistorySize();
     m_last_update_percept = agent.lastUpdatePercept();
 }
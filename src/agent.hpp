@@ -1,14 +1,34 @@
 #ifndef __AGENT_HPP__
 #define __AGENT_HPP__
 
+#include <cassert>
 #include <iostream>
+#include <vector>
 
 #include "main.hpp"
-
-class ContextTree;
+#include "model.hpp"
+#include "predict.hpp"
+#include "util.hpp"
 
 class ModelUndo;
 
+// The probabilities of the bits of a percept generated in a fixed model
+// state, as far as they are known. A cache is walked from the first bit of
+// a percept along the bits generated, see Agent::genPerceptAndUpdate().
+class PerceptCache {
+
+public:
+
+	virtual ~PerceptCache(void) { }
+
+	// the probability that the current bit is a 0, or -1 if not known
+	virtual double probZero(void) = 0;
+
+	// keep the probability of a 0 for the current bit, and move on to
+	// the bit following the given one
+	virtual void next(symbol_t sym, double prob_zero) = 0;
+};
+
 class Agent {
 
 public:
@@ -17,7 +37,12 @@ public:
 	Agent(options_t & options);
 
 	// destruct the agent and the corresponding context tree
-	~Agent(void);
+	virtual ~Agent(void);
+
+	// create an independent copy of the agent. A context tree model shares
+	// its nodes with this agent's until either of them modifies them, so
+	// forking takes constant time regardless of the size of the tree.
+	virtual Agent *fork(void) const;
 
 	// current age of the agent in cycles
 	age_t age(void) const;
@@ -52,6 +77,9 @@ public:
 	// the length of the stored history for an agent
 	size_t historySize(void) const;
 
+	// a hash of the agent's model context, see Model::contextHash()
+	uint64_t contextHash(void);
+
 	// length of the search horizon used by the agent
 	size_t horizon(void) const;
 
@@ -68,17 +96,53 @@ public:
 
 	// generate a percept distributed to our history statistics, and
 	// update our mixture environment model with it
-	void genPerceptAndUpdate(percept_t &obs, percept_t &rew); // TODO: implement in agent.cpp
+	virtual void genPerceptAndUpdate(percept_t &obs, percept_t &rew);
+
+	// As above, drawing each bit from the probability kept in the cache
+	// if there is one, so that the model is only updated with it. The
+	// probabilities computed by the model are added to the cache.
+	virtual void genPerceptAndUpdate(percept_t &obs, percept_t &rew,
+		PerceptCache &cache);
+
+	// the n most probable next percepts under the agent's model, most
+	// probable first, leaving the model as it was found
+	void probablePercepts(size_t n, std::vector<percept_t> &observations,
+		std::vector<percept_t> &rewards);
 
 	// update the internal agent's model of the world
 	// due to receiving a percept or performing an action
-	void modelUpdate(percept_t observation, percept_t reward);
-	void modelUpdate(action_t action);
+	virtual void modelUpdate(percept_t observation, percept_t reward);
+	virtual void modelUpdate(action_t action);
 
 	// revert the agent's internal model of the world
 	// to that of a previous time cycle, false on failure
 	bool modelRevert(const ModelUndo &mu);
 
+	// generate percepts from the rollout model until endRollout(), which
+	// reverts the rollout to the state saved in mu. If the rollout model is a
+	// separate model, the agent's main model is left untouched.
+	void beginRollout(void);
+	void endRollout(const ModelUndo &mu);
+
+	// the model used to generate percepts during rollouts
+	Model *rolloutModel(void) const { return m_rollout_model ? m_rollout_model : m_model; }
+
+	// the length of the history of the rollout model
+	size_t rolloutHistorySize(void) const;
+
+	// Lazy reverting. Between beginLazyRevert() and endLazyRevert(),
+	// modelRevert() only moves the agent back along the updates made since
+	// the start, which the models keep. Updates that repeat the kept ones
+	// move the agent forward again without touching the models, which are
+	// only reverted from the first update that differs. Kept percept
+	// symbols are resampled with the probabilities they were generated
+	// with, so that a percept that is generated again costs no model work.
+	void beginLazyRevert(void);
+	void endLazyRevert(void);
+
+	// bring the models back to the agent's state while reverting lazily
+	void syncModel(void);
+
 	// resets the agent
 	void reset(void);
 
@@ -86,12 +150,60 @@ public:
 	// agent's internal model of it's own behaviour
 	double getPredictedActionProb(action_t action); // TODO: implement in agent.cpp
 
-	// get the agent's probability of receiving a particular percept
-	double perceptProbability(percept_t observation, percept_t reward) const; // TODO: implement in agent.cpp
+	// get the agent's probability of receiving a particular percept. The
+	// model is updated with the percept and reverted, so it is not const.
+	double perceptProbability(percept_t observation, percept_t reward);
+
+    // io streaming of the agent's model(s)
+    void loadModel(std::istream &in);
+    void writeModel(std::ostream &out);
+
+protected:
+	// construct an agent around an already allocated context tree,
+	// which the agent takes ownership of
+	Agent(options_t & options, ContextTree *ct);
+
+	// fork an agent (see fork())
+	Agent(const Agent &other);
+
+	// the model representing the agent's beliefs
+	Model *model(void) const { return m_model; }
+
+	// True while generating percepts from the rollout model
+	bool inRollout(void) const { return m_in_rollout; }
+
+	// True while reverting lazily
+	bool lazyRevert(void) const { return m_lazy; }
+
+	// update the models with a symbol, or move past it if it is kept
+	void lazyUpdate(symbol_t sym, bool learned);
+
+	// generate a percept symbol, moving past a kept symbol if it is
+	// generated again. The probability of a 0 is computed by the model
+	// unless given (prob_zero >= 0), and returned in prob_zero.
+	symbol_t lazySample(double &prob_zero);
+	symbol_t lazySample(void) { double p = -1.0; return lazySample(p); }
+
+	// True if the last update was a percept update
+	bool m_last_update_percept;
+
+	// The total reward received by the agent
+	reward_t m_total_reward;
+
+	// How many time cycles the agent has been alive
+	age_t m_time_cycle;
 
-    void loadCT(std::istream &in);
-    void writeCT(std::ostream &out);
 private:
+	// agents are forked, never assigned
+	Agent &operator=(const Agent &other);
+
+	// read the agent properties from the options
+	void init(options_t & options);
+
+	// revert a model to a previous history size, see agent.cpp
+	bool revertModel(Model &model, size_t history_size,
+		bool last_update_percept, bool rollout) const;
+
 	// action sanity check
 	bool isActionOk(action_t action) const;
 
@@ -114,17 +226,171 @@ private:
 	unsigned int m_percepts;     // number of possible percepts
 	size_t m_horizon;            // length of the search horizon
 
-	// Context Tree representing the agent's beliefs
-	ContextTree *m_ct;
+	// Model representing the agent's beliefs, and the model used to
+	// generate rollouts if that is a different one (NULL otherwise)
+	Model *m_model;
+	Model *m_rollout_model;
+
+	// True while generating percepts from the rollout model
+	bool m_in_rollout;
+
+	// A symbol kept by lazy reverting
+	struct journal_entry_t {
+		symbol_t symbol;
+		bool learned;      // true for a percept symbol, false for an action's
+		double prob_zero;  // the probability of a 0 it was sampled with, or -1
+	};
+
+	// generate a percept symbol outside of rollouts, see lazySample()
+	symbol_t sampleSymbol(double &prob_zero);
+
+	bool m_lazy;                // true while reverting lazily
+	std::vector<journal_entry_t> m_journal; // the kept symbols, oldest first
+	size_t m_cursor;            // the number of kept symbols the agent is past
+	size_t m_journal_base;      // history sizes of the models before them
+	size_t m_rollout_journal_base;
+};
 
-	// How many time cycles the agent has been alive
-	age_t m_time_cycle;
 
-	// The total reward received by the agent
-	reward_t m_total_reward;
+// An agent whose action/percept bit widths and context tree depth are known
+// at compile time. Percepts and actions are fed to the context tree one bit at
+// a time with constant trip counts, instead of going through symbol lists, in
+// rollouts and while reverting lazily as well. A separate rollout model is
+// kept in step with the context tree bit by bit.
+template <unsigned int ActBits, unsigned int ObsBits, unsigned int RewBits,
+          size_t Depth>
+class FixedAgent : public Agent {
 
-	// True if the last update was a percept update
-	bool m_last_update_percept;
+public:
+
+	FixedAgent(options_t & options) :
+		Agent(options, new FixedContextTree<Depth>()) {
+
+		m_fixed_ct = static_cast<FixedContextTree<Depth> *>(model());
+	}
+
+	FixedAgent(const FixedAgent &other) : Agent(other) {
+		m_fixed_ct = static_cast<FixedContextTree<Depth> *>(model());
+	}
+
+	virtual Agent *fork(void) const {
+		return new FixedAgent(*this);
+	}
+
+	virtual void genPerceptAndUpdate(percept_t &obs, percept_t &rew) {
+		assert(m_last_update_percept == false);
+
+		obs = 0;
+		for (unsigned int i = 0; i < ObsBits; ++i) {
+			obs |= (percept_t) genSymbol() << i;
+		}
+		rew = 0;
+		for (unsigned int i = 0; i < RewBits; ++i) {
+			rew |= (percept_t) genSymbol() << i;
+		}
+
+		m_last_update_percept = true;
+		m_total_reward += rew;
+	}
+
+	virtual void genPerceptAndUpdate(percept_t &obs, percept_t &rew,
+			PerceptCache &cache) {
+		assert(m_last_update_percept == false);
+		assert(!inRollout());
+
+		obs = 0;
+		for (unsigned int i = 0; i < ObsBits; ++i) {
+			obs |= (percept_t) cachedSymbol(cache) << i;
+		}
+		rew = 0;
+		for (unsigned int i = 0; i < RewBits; ++i) {
+			rew |= (percept_t) cachedSymbol(cache) << i;
+		}
+
+		m_last_update_percept = true;
+		m_total_reward += rew;
+	}
+
+	virtual void modelUpdate(percept_t observation, percept_t reward) {
+		assert(m_last_update_percept == false);
+
+		for (unsigned int i = 0; i < ObsBits; ++i) {
+			learn((observation >> i) & 1);
+		}
+		for (unsigned int i = 0; i < RewBits; ++i) {
+			learn((reward >> i) & 1);
+		}
+
+		m_total_reward += reward;
+		m_last_update_percept = true;
+	}
+
+	virtual void modelUpdate(action_t action) {
+		assert(m_last_update_percept == true);
+		assert(action < numActions());
+
+		for (unsigned int i = 0; i < ActBits; ++i) {
+			symbol_t sym = (action >> i) & 1;
+			if (lazyRevert() && !inRollout()) {
+				lazyUpdate(sym, false);
+				continue;
+			}
+			if (!inRollout() || !separateRollouts()) m_fixed_ct->updateHistory(sym);
+			if (separateRollouts()) rolloutModel()->updateHistory(sym);
+		}
+
+		m_time_cycle++;
+		m_last_update_percept = false;
+	}
+
+private:
+
+	// true if rollouts are generated by a model of their own
+	bool separateRollouts(void) const { return rolloutModel() != m_fixed_ct; }
+
+	// generate a percept symbol from the model the agent samples in its
+	// current state, and update the models with it
+	symbol_t genSymbol(void) {
+		if (inRollout()) return rolloutModel()->genRolloutSymbol();
+		if (lazyRevert()) return lazySample();
+		symbol_t sym = m_fixed_ct->genRandomSymbolAndUpdate();
+		if (separateRollouts()) rolloutModel()->update(sym);
+		return sym;
+	}
+
+	// generate a percept symbol with the probability kept in the cache,
+	// if any, see Agent::genPerceptAndUpdate()
+	symbol_t cachedSymbol(PerceptCache &cache) {
+		double prob_zero = cache.probZero();
+		symbol_t sym;
+		if (lazyRevert()) {
+			sym = lazySample(prob_zero);
+		} else {
+			if (prob_zero >= 0.0) {
+				sym = rand01() > prob_zero;
+				m_fixed_ct->FixedContextTree<Depth>::update(sym);
+			} else {
+				sym = m_fixed_ct->genRandomSymbolAndUpdate(prob_zero);
+			}
+			if (separateRollouts()) rolloutModel()->update(sym);
+		}
+		cache.next(sym, prob_zero);
+		return sym;
+	}
+
+	// update the models with a percept symbol
+	void learn(symbol_t sym) {
+		if (lazyRevert() && !inRollout()) {
+			lazyUpdate(sym, true);
+			return;
+		}
+		if (!inRollout() || !separateRollouts()) {
+			m_fixed_ct->FixedContextTree<Depth>::update(sym);
+		}
+		if (separateRollouts()) rolloutModel()->update(sym);
+	}
+
+	FixedContextTree<Depth> *m_fixed_ct;
 };
 
 
@@ -145,12 +411,16 @@ class ModelUndo {
         // saved state history size accessor
         size_t historySize(void) const { return m_history_size; }
 
+        // saved state history size of the rollout model
+        size_t rolloutHistorySize(void) const { return m_rollout_history_size; }
+
         bool lastUpdatePercept(void) const { return m_last_update_percept; }
 
     private:
         age_t m_age;
         reward_t m_reward;
         size_t m_history_size;
+        size_t m_rollout_history_size;
         bool m_last_update_percept;
 };
 
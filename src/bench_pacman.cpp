@@ -0,0 +1,33 @@
+#include "environment.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+#include "util.hpp"
+
+// Step rate of the pacman environment: plays random actions for a number
+// of steps, restarting games as they end, and reports steps per second.
+//
+// usage: ./bench_pacman [steps] [seed]
+int main(int argc, char *argv[]) {
+	unsigned long steps = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	seedRandom(argc > 2 ? strtoull(argv[2], NULL, 10) : 1);
+
+	options_t options;
+	Pacman env(options);
+
+	// the percepts are summed so that the steps cannot be optimised away
+	unsigned long long total = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (unsigned long i = 0; i < steps; i++) {
+		env.performAction(randRange(4U));
+		total += env.getObservation() + env.getReward();
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	std::cout << steps << " steps in " << elapsed.count() << " s, "
+		<< (unsigned long) (steps / elapsed.count()) << " steps/s"
+		<< " (checksum " << total << ")" << std::endl;
+	return 0;
+}
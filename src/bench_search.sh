@@ -0,0 +1,39 @@
+#!/bin/sh
+# Scaling of parallel search: runs the same number of agent cycles on
+# pacman and tiger with 1, 2, 4, ... up to N search threads, for root and
+# tree parallel search, and reports the simulations per second summed from
+# the verbose log, and their speedup over a single thread.
+#
+# usage: ./bench_search.sh [max threads] [cycles] [mc-timelimit]
+
+max_threads=${1:-$(nproc)}
+cycles=${2:-20}
+timelimit=${3:-2000}
+conf=$(dirname "$0")/../conf
+logs=$(mktemp -d)
+
+# the speedups are only meaningful up to the number of cores
+echo "$(nproc) cores"
+printf "%-8s %-6s %8s %10s %8s\n" environment search threads "sims/s" speedup
+for env in pacman tiger; do
+for parallelism in root tree; do
+	base=""
+	threads=1
+	while [ $threads -le $max_threads ]; do
+		start=$(date +%s.%N)
+		$(dirname "$0")/aixi $conf/$env.conf --exploration=0 \
+			--terminate-age=$cycles --mc-timelimit=$timelimit \
+			--search-threads=$threads --search-parallelism=$parallelism \
+			--log=$logs/$env > /dev/null 2>&1
+		end=$(date +%s.%N)
+		simulations=$(awk '/^simulations:/ { n += $2 } END { print n + 0 }' $logs/$env.log)
+		rate=$(echo "$start $end $simulations" | awk '{ printf "%.0f", $3 / ($2 - $1) }')
+		[ -z "$base" ] && base=$rate
+		speedup=$(echo "$base $rate" | awk '{ printf "%.2f", $2 / $1 }')
+		printf "%-8s %-6s %8d %10s %8s\n" $env $parallelism $threads $rate $speedup
+		threads=$((threads * 2))
+	done
+done
+done
+
+rm -rf $logs
@@ -0,0 +1,69 @@
+#include "budget.hpp"
+
+#include "util.hpp"
+
+// the bounds of a search's budget, relative to an even share
+static const double min_share = 0.25;
+static const double max_share = 4.0;
+
+// the weight of the latest difficulty in its moving average
+static const double difficulty_rate = 0.1;
+
+
+BudgetManager::BudgetManager(options_t &options, bool deadline) :
+	m_window(0),
+	m_budget(0),
+	m_remaining(0),
+	m_searches(0),
+	m_allocated(0),
+	m_difficulty(1.0),
+	m_mean_difficulty(1.0)
+{
+	if (options.count("budget-window") > 0) {
+		strExtract(options["budget-window"], m_window);
+	}
+	if (deadline && options.count("search-deadline-ms") > 0) {
+		strExtract(options["search-deadline-ms"], m_budget);
+	}
+	if (m_budget == 0 && options.count("mc-timelimit") > 0) {
+		strExtract(options["mc-timelimit"], m_budget);
+	}
+}
+
+
+// Give the next search an even share of what is left of the window's
+// budget, scaled by how hard the last decision looked compared to the
+// recent ones. A new window starts once the last one's searches are done.
+timelimit_t BudgetManager::allocate(void) {
+	if (!enabled()) return m_budget;
+
+	if (m_searches == 0) {
+		m_searches = m_window;
+		m_remaining = m_budget * m_window;
+	}
+
+	double even = (double) m_remaining / m_searches;
+	double share = even * m_difficulty / m_mean_difficulty;
+	if (share < min_share * even) share = min_share * even;
+	if (share > max_share * even) share = max_share * even;
+
+	m_allocated = (timelimit_t) share;
+	if (m_searches == 1 || m_allocated > m_remaining) m_allocated = m_remaining;
+	m_remaining -= m_allocated;
+	m_searches--;
+	return m_allocated;
+}
+
+
+// Decisions whose best actions are close in value, or that were followed by
+// a surprising percept, count as hard. Budget a search left unused goes
+// back to the window.
+void BudgetManager::record(double gap, double surprise, timelimit_t used) {
+	if (!enabled()) return;
+
+	if (used < m_allocated && m_searches > 0) m_remaining += m_allocated - used;
+	m_allocated = 0;
+
+	m_difficulty = (1.0 - gap) + surprise + 0.1;
+	m_mean_difficulty += difficulty_rate * (m_difficulty - m_mean_difficulty);
+}
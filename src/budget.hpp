@@ -0,0 +1,44 @@
+#ifndef __BUDGET_HPP__
+#define __BUDGET_HPP__
+
+#include "main.hpp"
+
+// Shares a search budget between the decisions of an agent. A search's
+// budget is 'mc-timelimit' simulations, or 'search-deadline-ms'
+// milliseconds if searches have a deadline. With 'budget-window' above zero, every
+// 'budget-window' searches share a budget of that many search budgets,
+// and each search is given a part of what is left in proportion to how
+// hard the last decision looked: how close the values of its best two
+// actions were, and how surprising the percept that followed it was.
+class BudgetManager {
+
+public:
+
+	// a manager of the budget configured by the options, in milliseconds
+	// if searches have a deadline (see Searcher::hasDeadline())
+	BudgetManager(options_t &options, bool deadline);
+
+	// true if budgets are adapted to the decisions
+	bool enabled(void) const { return m_window > 0; }
+
+	// the budget of the next search
+	timelimit_t allocate(void);
+
+	// Report what the last search found and used. 'gap' is the difference
+	// of the values of its best two actions relative to the largest
+	// possible value, and 'surprise' the information of the percept that
+	// followed, in bits per percept bit. Both lie in [0, 1].
+	void record(double gap, double surprise, timelimit_t used);
+
+private:
+
+	unsigned int m_window;      // number of searches sharing a budget
+	timelimit_t m_budget;       // the budget of a search, on average
+	timelimit_t m_remaining;    // what is left of the window's budget
+	unsigned int m_searches;    // searches left in the window
+	timelimit_t m_allocated;    // the budget of the last search
+	double m_difficulty;        // how hard the last decision looked
+	double m_mean_difficulty;   // moving average of the difficulty
+};
+
+#endif // __BUDGET_HPP__
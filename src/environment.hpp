@@ -1,6 +1,8 @@
 #ifndef __ENVIRONMENT_HPP__
 #define __ENVIRONMENT_HPP__
 
+#include <stdint.h>
+
 #include "main.hpp"
 
 class Environment {
@@ -10,6 +12,9 @@ public:
 	// Constructor: set up the initial environment percept
 	// TODO: implement in inherited class
 
+	// destroy the environment
+	virtual ~Environment(void) { }
+
 	// receives the agent's action and calculates the new environment percept
 	virtual void performAction(action_t action) = 0; // TODO: implement in inherited class
 
@@ -148,17 +153,54 @@ private:
         int col;
     };
 
+    // Size of maze
+    const static int size = 19;
+    // Words of a set of locations
+    const static int words = (size * size + 63) / 64;
+
+    // A set of locations, with a bit per location "(row * size) + col"
+    struct bitboard {
+        uint64_t w[words];
+
+        bool test(int i) const { return (w[i >> 6] >> (i & 63)) & 1; }
+        void set(int i) { w[i >> 6] |= 1ULL << (i & 63); }
+        void clear(int i) { w[i >> 6] &= ~(1ULL << (i & 63)); }
+
+        // true if any location is in both sets
+        bool meets(const bitboard &other) const {
+            uint64_t any = 0;
+            for (int k = 0; k < words; k++) any |= w[k] & other.w[k];
+            return any != 0;
+        }
+    };
+
     // State of the game
     bool endState;
 
-    // Size of maze
-    const static int size = 19;
     // Maze as shown by the diagram in the assignment spec
     const static bool maze[size][size];
     // Adjacency list for non-wall locations
     const static std::vector< std::vector<int> > adjList;
-    // Current world
-    int world[size][size];
+    // First move on a shortest path between any two locations, indexed
+    // by "(src * size * size) + dest"
+    const static std::vector<unsigned char> nextMove;
+    // Moves out of each location that are not into a wall
+    const static std::vector< std::vector<action_t> > openMoves;
+    // Wall locations as a set
+    const static bitboard wallBoard;
+    // Locations seen in each direction from each location, up to the
+    // first wall, indexed by "(location * m_num_actions) + direction"
+    const static std::vector<bitboard> rays;
+    // Locations scanned for smells around each location, indexed by
+    // "(location * (max_scan + 1)) + range", see entityScan()
+    const static int max_scan = 4;
+    const static std::vector<bitboard> scans;
+    // Current world, as the locations of each entity. Pacman's location
+    // holds no other entity, and a ghost may share its location with
+    // food or a power pellet.
+    bitboard foodBoard;
+    bitboard powerBoard;
+    bitboard ghostBoard;
     
 
     /* Entities */
@@ -224,6 +266,8 @@ private:
     // Basic world utilities
     void reset(void);
     void updateWorldPositions(void);
+    int cellAt(int row, int col);
+    const bitboard &entityBoard(const int ent);
     bool entityAt(int row, int col, const int ent);
     bool entityScan(point &p, int range, const int ent);
     bool lineOfSight(point &p, action_t dir, const int ent);
@@ -236,6 +280,12 @@ private:
     void eatGhosts(point &p);
     // BFS to chase pacman
     static std::vector< std::vector<int> > genAdjList(void);
+    static std::vector<unsigned char> genNextMove(void);
+    static std::vector< std::vector<action_t> > genOpenMoves(void);
+    // Precomputed sets of locations for observations
+    static bitboard genWallBoard(void);
+    static std::vector<bitboard> genRays(void);
+    static std::vector<bitboard> genScans(void);
     action_t shortestMove(point &src, point &dest);
 
 };
@@ -0,0 +1,204 @@
+#include "host.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+#include "agent.hpp"
+#include "environment.hpp"
+#include "session.hpp"
+#include "threadpool.hpp"
+#include "util.hpp"
+
+
+// An agent run by the host
+struct Tenant {
+	std::string conf;      // the agent's configuration file
+	Session *session;      // the agent's interaction loop
+	rng_state_t rng;       // the agent's random stream
+};
+
+
+// Swaps a tenant's random stream into the calling thread for its lifetime
+class TenantRandom {
+
+public:
+
+	TenantRandom(Tenant &tenant) : m_tenant(tenant), m_saved(rngState()) {
+		rngState() = m_tenant.rng;
+	}
+
+	~TenantRandom(void) {
+		m_tenant.rng = rngState();
+		rngState() = m_saved;
+	}
+
+private:
+
+	Tenant &m_tenant;
+	rng_state_t m_saved;
+};
+
+
+// Set up a tenant from a line of the host list, returning false on failure
+static bool createTenant(Tenant &tenant, const std::string &line,
+		const options_t &defaults, unsigned int index, uint64_t seed) {
+
+	// Split the line into the configuration file and its overrides
+	std::istringstream iss(line);
+	std::vector<std::string> args;
+	std::string arg;
+	while (iss >> arg) args.push_back(arg);
+	tenant.conf = args[0];
+
+	// Each agent logs to its own files unless it says otherwise
+	options_t options = defaults;
+	options["host"] = "";
+	// the host's seed is only the base of each agent's own
+	options.erase("seed");
+	std::ostringstream log;
+	log << defaults.find("log")->second << "-" << index;
+	options["log"] = log.str();
+
+	std::ifstream conf(tenant.conf.c_str());
+	if (!conf.is_open()) {
+		std::cerr << "ERROR: Could not open file '" << tenant.conf << "'" << std::endl;
+		return false;
+	}
+	processOptions(conf, options);
+	conf.close();
+
+	std::vector<char *> argv;
+	for (size_t i = 0; i < args.size(); i++) {
+		argv.push_back(&args[i][0]);
+	}
+	parseCmdOptions(argv.size(), &argv[0], options);
+
+	// Seed the agent's random stream before anything draws from it, from
+	// its own line or configuration if either gives a seed
+	if (options.count("seed") > 0) {
+		strExtract(options["seed"], seed);
+	}
+	tenant.rng = randomState(seed);
+	TenantRandom random(tenant);
+
+	if (!Searcher::checkOptions(options)) return false;
+	Environment *env = createEnvironment(options);
+	if (!env) return false;
+
+	Agent *agent = createAgent(options);
+	loadModel(*agent, options);
+
+	tenant.session = new Session(options, agent, env, NULL);
+	return true;
+}
+
+
+// Run a quantum of cycles of a tenant, rescheduling it until it finishes
+static void runQuantum(ThreadPool &pool, Tenant &tenant, unsigned int quantum) {
+	{
+		// the random stream is saved before the tenant can be rescheduled
+		TenantRandom random(tenant);
+		for (unsigned int i = 0; i < quantum; i++) {
+			if (!tenant.session->step()) {
+				tenant.session->finish();
+				return;
+			}
+		}
+	}
+	pool.submit([&pool, &tenant, quantum]() {
+		runQuantum(pool, tenant, quantum);
+	});
+}
+
+
+// Run many agent/environment configurations in this process
+int runHost(options_t &options) {
+	std::ifstream list(options["host"].c_str());
+	if (!list.is_open()) {
+		std::cerr << "ERROR: Could not open host list '" << options["host"] << "'" << std::endl;
+		return -1;
+	}
+
+	unsigned int threads, quantum;
+	strExtract(options["host-threads"], threads);
+	strExtract(options["host-quantum"], quantum);
+	if (threads == 0) threads = std::thread::hardware_concurrency();
+	if (threads == 0) threads = 1;
+	if (quantum == 0) quantum = 1;
+
+	// Set up the agents, seeding each one's random stream in turn
+	uint64_t seed = time(NULL);
+	if (options.count("seed") > 0) {
+		strExtract(options["seed"], seed);
+	}
+	std::vector<Tenant> tenants;
+	std::string line;
+	while (std::getline(list, line)) {
+		size_t pos;
+		if ((pos = line.find('#')) != std::string::npos) {
+			line = line.substr(0, pos);
+		}
+		if (line.find_first_not_of(" \t") == std::string::npos) continue;
+
+		Tenant tenant;
+		unsigned int index = tenants.size();
+		if (!createTenant(tenant, line, options, index, seed + index)) {
+			std::cerr << "WARNING: skipping host list entry '" << line << "'" << std::endl;
+			continue;
+		}
+		tenants.push_back(tenant);
+	}
+	list.close();
+
+	// A running agent keeps its own search and ponder threads busy, so only
+	// as many agents run at once as the host's threads allow. An agent that
+	// needs more threads than that still runs, on a single worker.
+	unsigned int agent_threads = 1;
+	for (size_t i = 0; i < tenants.size(); i++) {
+		agent_threads = std::max(agent_threads, tenants[i].session->searcher().threads());
+	}
+	unsigned int workers = std::max(1u, threads / agent_threads);
+
+	std::cout << "hosting " << tenants.size() << " agents on " << workers
+			<< " workers of up to " << agent_threads << " threads each ("
+			<< threads << " threads)..." << std::endl;
+
+	// Run every agent to completion on the worker pool
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	{
+		ThreadPool pool(workers);
+		for (size_t i = 0; i < tenants.size(); i++) {
+			Tenant &tenant = tenants[i];
+			pool.submit([&pool, &tenant, quantum]() {
+				runQuantum(pool, tenant, quantum);
+			});
+		}
+		pool.wait();
+	}
+	double elapsed = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+
+	// Print a summary of each agent and the throughput of the host
+	unsigned long long cycles = 0;
+	std::cout << std::endl << std::endl << "SUMMARY" << std::endl;
+	for (size_t i = 0; i < tenants.size(); i++) {
+		const Agent &ai = tenants[i].session->agent();
+		std::cout << i << ": " << tenants[i].conf << ", agent age: " << ai.age()
+				<< ", average reward: " << ai.averageReward() << std::endl;
+		cycles += tenants[i].session->cycles();
+		delete tenants[i].session;
+	}
+	std::cout << "agent cycles: " << cycles << std::endl;
+	std::cout << "elapsed seconds: " << elapsed << std::endl;
+	std::cout << "agent cycles per second: "
+			<< (elapsed > 0.0 ? cycles / elapsed : 0.0) << std::endl;
+
+	return 0;
+}
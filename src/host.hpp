@@ -0,0 +1,17 @@
+#ifndef __HOST_HPP__
+#define __HOST_HPP__
+
+#include "main.hpp"
+
+// Run every agent/environment configuration listed in the file named by the
+// 'host' option in this process. Agents are scheduled a 'host-quantum' of
+// cycles at a time, each with its own random stream and logs. An agent's
+// search and ponder threads count against the 'host-threads' budget: the
+// pool runs as many agents at once as fit in it with the threads of the
+// most demanding agent. At least one agent runs, so an agent needing more
+// threads than the budget oversubscribes the host. The host's options are the defaults for every
+// agent. Each line of the list holds a configuration file followed by
+// optional '--key=value' overrides.
+int runHost(options_t &options);
+
+#endif // __HOST_HPP__
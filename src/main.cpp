@@ -1,149 +1,17 @@
 #include "main.hpp"
 
-#include <cassert>
 #include <fstream>
 #include <iostream>
 #include <string>
 #include <time.h>
-#include <stdlib.h>
 
 #include "agent.hpp"
 #include "environment.hpp"
-#include "search.hpp"
+#include "host.hpp"
+#include "session.hpp"
 #include "util.hpp"
 
 
-// Streams for logging
-std::ofstream verboseLog;        // A verbose human-readable log
-std::ofstream compactLog; // A compact comma-separated value log
-
-// The main agent/environment interaction loop
-void mainLoop(Agent &ai, Environment &env, options_t &options) {
-
-	// Determine exploration options
-	bool explore = options.count("exploration") > 0;
-	double explore_rate, explore_decay;
-	if (explore) {
-		strExtract(options["exploration"], explore_rate);
-		strExtract(options["explore-decay"], explore_decay);
-		assert(0.0 <= explore_rate && explore_rate <= 1.0);
-		assert(0.0 <= explore_decay && explore_decay <= 1.0);
-	}
-
-    
-	// Determine termination age
-	bool terminate_check = options.count("terminate-age") > 0;
-	age_t terminate_age;
-	if (terminate_check) {
-		strExtract(options["terminate-age"], terminate_age);
-		assert(0 <= terminate_age);
-	}
-
-    // Determine mc-timelimit
-    timelimit_t mc_timelimit;
-    strExtract(options["mc-timelimit"], mc_timelimit);
-    //if we assume that time_limit > agent.numActions() we can be sure 
-    //that every action is selected at least once
-    if(mc_timelimit < ai.numActions()){
-        std::cerr << "WARNING: time_limit not large enough to sample all actions" << std::endl;
-    }
-
-	// Determine whether to write cts during the process, or only at the end.
-    bool intermediate_ct = true;
-    if(options.count("intermediate-ct") > 0){
-        intermediate_ct = !(options["intermediate-ct"] == "0");
-    }
-
-    std::cout << "starting agent/environment interaction loop...\n"; 
-	// Agent/environment interaction loop
-	for (unsigned int cycle = 1; !env.isFinished(); cycle++) {
-
-		// check for agent termination
-		if (terminate_check && ai.age() >= terminate_age) {
-			verboseLog << "info: terminating agent" << std::endl;
-			break;
-		}
-
-		// Get a percept from the environment
-		percept_t observation = env.getObservation();
-		percept_t reward = env.getReward();
-
-		// Update agent's environment model with the new percept
-		ai.modelUpdate(observation, reward);
-
-		// Determine best exploitive action, or explore
-		action_t action;
-		bool explored = false;
-		if (explore && rand01() < explore_rate) {
-			explored = true;
-			action = ai.genRandomAction();
-		}
-		else {
-			action = search(ai, mc_timelimit);
-		}
-
-		// Send an action to the environment
-		env.performAction(action); 
-
-		// Update agent's environment model with the chosen action
-		ai.modelUpdate(action); 
-
-		// Log this turn
-		verboseLog << "cycle: " << cycle << std::endl;
-		verboseLog << "observation: " << observation << std::endl;
-		verboseLog << "reward: " << reward << std::endl;
-		verboseLog << "action: " << action << std::endl;
-		verboseLog << "explored: " << (explored ? "yes" : "no") << std::endl;
-		verboseLog << "explore rate: " << explore_rate << std::endl;
-		verboseLog << "total reward: " << ai.reward() << std::endl;
-		verboseLog << "average reward: " << ai.averageReward() << std::endl;
-
-		// Log the data in a more compact form
-		compactLog << cycle << ", " << observation << ", " << reward << ", "
-				<< action << ", " << explored << ", " << explore_rate << ", "
-				<< ai.reward() << ", " << ai.averageReward() << std::endl;
-
-		// Print to standard output when cycle == 2^n
-		if ((cycle & (cycle - 1)) == 0) {
-			std::cout << "cycle: " << cycle << std::endl;
-			std::cout << "average reward: " << ai.averageReward() << std::endl;
-			if (explore) {
-				std::cout << "explore rate: " << explore_rate << std::endl;
-			}
-
-			// Write context tree file
-			if(options["write-ct"] != "" && intermediate_ct){
-				// write a ct for each 2^n cycles.
-				char cycle_string[256];
-				sprintf(cycle_string, "%d", cycle);
-				std::ofstream ct((options["write-ct"] + std::string(cycle_string) + ".ct").c_str());
-				ai.writeCT(ct);
-				ct.close();
-			}
-		}
-
-		// Update exploration rate
-		if (explore) explore_rate *= explore_decay;
-
-	}
-
-	// Print summary to standard output
-	std::cout << std::endl << std::endl << "SUMMARY" << std::endl;
-	std::cout << "agent age: " << ai.age() << std::endl;
-	std::cout << "average reward: " << ai.averageReward() << std::endl;
-
-    // Write context tree file
-    if(options["write-ct"] != ""){
-    	// write a ct for the final cycle too.
-		char cycle_string[256];
-		sprintf(cycle_string, "%lld", ai.age());
-		std::ofstream ct((options["write-ct"] + std::string(cycle_string) + ".ct").c_str());
-		ai.writeCT(ct);
-		ct.close();
-    }
-}
-
-
 // Populate the 'options' map based on 'key=value' pairs from an input stream
 void processOptions(std::ifstream &in, options_t &options) {
 	std::string line;
@@ -209,6 +77,49 @@ void parseCmdOptions(int argc, char *argv[], options_t &options){
     }
 }
 
+// Construct a FixedAgent if the configuration matches its template arguments
+template <unsigned int ActBits, unsigned int ObsBits, unsigned int RewBits,
+          size_t Depth>
+static Agent *fixedAgent(options_t &options, unsigned int act_bits,
+		unsigned int obs_bits, unsigned int rew_bits, size_t depth) {
+	if (act_bits != ActBits || obs_bits != ObsBits || rew_bits != RewBits
+			|| depth != Depth) {
+		return NULL;
+	}
+	return new FixedAgent<ActBits, ObsBits, RewBits, Depth>(options);
+}
+
+// Construct the agent, using a compile-time specialization when the
+// configuration matches one of the shipped environments
+Agent *createAgent(options_t &options) {
+	unsigned int act_bits =
+		bitsRequired(strExtract<unsigned int>(options["agent-actions"]));
+	unsigned int obs_bits = strExtract<unsigned int>(options["observation-bits"]);
+	unsigned int rew_bits = strExtract<unsigned int>(options["reward-bits"]);
+	size_t depth = strExtract<size_t>(options["ct-depth"]);
+
+	// only the context tree model is specialized
+	Agent *agent = NULL;
+	if (options["model"] != "ctw") {
+		return new Agent(options);
+	}
+
+	// coin-flip
+	if (!agent) agent = fixedAgent<1, 1, 1, 16>(options, act_bits, obs_bits, rew_bits, depth);
+	// tiger
+	if (!agent) agent = fixedAgent<2, 2, 7, 96>(options, act_bits, obs_bits, rew_bits, depth);
+	// biased-rock-paper-scissor
+	if (!agent) agent = fixedAgent<2, 2, 2, 32>(options, act_bits, obs_bits, rew_bits, depth);
+	// kuhn-poker
+	if (!agent) agent = fixedAgent<1, 4, 3, 42>(options, act_bits, obs_bits, rew_bits, depth);
+	// pacman
+	if (!agent) agent = fixedAgent<2, 16, 8, 96>(options, act_bits, obs_bits, rew_bits, depth);
+
+	// fall back to the runtime sized agent
+	if (!agent) agent = new Agent(options);
+	return agent;
+}
+
 void printOptions(options_t &options){
     std::cout << "Agent configuration:\n------------------------------\n";
     for(options_t::iterator it = options.begin(); it != options.end(); ++it){
@@ -217,19 +128,8 @@ void printOptions(options_t &options){
     std::cout << std::endl;
 }
 
-int main(int argc, char *argv[]) {
-	if (argc < 2) {
-		std::cerr << "USAGE: ./aixi agent.conf [--option1=value1 --option2=value2 ...] " << std::endl;
-		std::cerr << "The first argument should indicate the location of the configuration file. Further arguments can either be specified in the config file or passed as command line option. Command line options are used over options specified in the file." << std::endl;
-		return -1;
-	}
-    // Initialize random seed
-    srand(time(NULL));
-
-	// Load configuration options
-	options_t options;
-
-	// Default configuration values
+// Default configuration values
+void setDefaultOptions(options_t &options) {
 	options["ct-depth"] = "16";
 	options["agent-horizon"] = "3";
 	options["exploration"] = "0";     // do not explore
@@ -240,28 +140,38 @@ int main(int argc, char *argv[]) {
     options["load-ct"] = "";
     options["write-ct"] = "";
     options["intermediate-ct"] = "1";
+    options["model"] = "ctw";         // context tree weighting
+    options["rollout-model"] = "";    // rollouts use the agent's model
+    options["rollout-ct-depth"] = "0"; // rollouts use the full context tree
+    options["ngram-order"] = "16";
+    options["ngram-table-bits"] = "18";
+    options["search-threads"] = "1"; // serial search
+    options["search-parallelism"] = "root"; // threads grow their own trees
+    options["rollouts-per-leaf"] = "1";
+    options["search-reuse"] = "1";    // warm start each search
+    options["search-deadline-ms"] = "0"; // search for mc-timelimit simulations
+    options["widening-c"] = "0";      // no progressive widening
+    options["widening-alpha"] = "0.5";
+    options["percept-abstraction"] = "full"; // branch on whole percepts
+    options["observation-mask"] = "0";
+    options["transposition-bits"] = "0"; // no transposition table
+    options["ponder"] = "0";          // no pondering while the environment acts
+    options["early-stop"] = "0";      // searches use their whole budget
+    options["early-stop-delta"] = "0.01";
+    options["budget-window"] = "0";   // the same budget for every search
+    options["lazy-revert"] = "0";     // revert the agent fully after each simulation
+    options["percept-cache"] = "0";   // sample every percept of a chance node from the model
+    options["rollout-length"] = "0";  // play out to the end of the horizon
+    options["search-max-nodes"] = "0"; // no limit on the nodes of a search
+    options["search-deterministic"] = "0"; // searches draw from the agent's stream
+    options["host"] = "";             // run a single agent
+    options["host-threads"] = "0";    // one thread per hardware thread, shared by the agents
+    options["host-quantum"] = "16";   // cycles per scheduled agent slice
+}
 
-	// Read configuration options
-	std::ifstream conf(argv[1]);
-	if (!conf.is_open()) {
-		std::cerr << "ERROR: Could not open file '" << argv[1] << "' now exiting" << std::endl;
-		return -1;
-	}
-	processOptions(conf, options);
-	conf.close();
-
-    //parse command line options (overwrites values of config files)
-    parseCmdOptions(argc, argv, options);
-
-	// Set up logging
-	std::string log_file = options["log"];
-	verboseLog.open((log_file + ".log").c_str());
-	compactLog.open((log_file + ".csv").c_str());
-
-	// Print header to compactLog
-	compactLog << "cycle, observation, reward, action, explored, explore_rate, total reward, average reward" << std::endl;
-
-	// Set up the environment
+// Set up the environment, and the percept and action sizes the agent
+// needs to interact with it
+Environment *createEnvironment(options_t &options) {
 	Environment *env;
 	std::string environment_name = options["environment"];
 	if (environment_name == "coin-flip") {
@@ -296,32 +206,84 @@ int main(int argc, char *argv[]) {
 	}
 	else {
 		std::cerr << "ERROR: unknown environment '" << environment_name << "'" << std::endl;
-		return -1;
+		return NULL;
 	}
+	return env;
+}
 
-    printOptions(options);
-
-	// Set up the agent
-	Agent ai(options);
-
-	// If specified, load a pretrained context tree.
+// If specified, load a pretrained context tree.
+void loadModel(Agent &ai, options_t &options) {
     if(options["load-ct"] != ""){
         std::ifstream ct(options["load-ct"].c_str());
 
         if(ct.is_open()){
-            ai.loadCT(ct);
+            ai.loadModel(ct);
+            if(ct.fail()){
+                std::cerr << "WARNING: model file is malformed or does not match the configured model.\n";
+            }
         }
         else{
             std::cerr << "WARNING: specified context tree file could not be loaded.\n";
         }
         ct.close();
-    }  
+    }
+}
 
-	// Run the main agent/environment interaction loop
-	mainLoop(ai, *env, options);
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		std::cerr << "USAGE: ./aixi agent.conf [--option1=value1 --option2=value2 ...] " << std::endl;
+		std::cerr << "The first argument should indicate the location of the configuration file. Further arguments can either be specified in the config file or passed as command line option. Command line options are used over options specified in the file." << std::endl;
+		return -1;
+	}
+	// Load configuration options
+	options_t options;
+
+	// Default configuration values
+	setDefaultOptions(options);
+
+	// Read configuration options
+	std::ifstream conf(argv[1]);
+	if (!conf.is_open()) {
+		std::cerr << "ERROR: Could not open file '" << argv[1] << "' now exiting" << std::endl;
+		return -1;
+	}
+	processOptions(conf, options);
+	conf.close();
 
-	verboseLog.close();
-	compactLog.close();
+    //parse command line options (overwrites values of config files)
+    parseCmdOptions(argc, argv, options);
+
+    // Initialize random seed, from the clock unless one is given
+    uint64_t seed = time(NULL);
+    if (options.count("seed") > 0) {
+        strExtract(options["seed"], seed);
+    }
+    seedRandom(seed);
+
+	// Run many agents in this process if a host list is given
+	if (options["host"] != "") {
+		return runHost(options);
+	}
+
+	if (!Searcher::checkOptions(options)) return -1;
+
+	// Set up the environment
+	Environment *env = createEnvironment(options);
+	if (!env) return -1;
+
+    printOptions(options);
+
+	// Set up the agent
+	Agent *agent = createAgent(options);
+
+	// If specified, load a pretrained context tree.
+	loadModel(*agent, options);
+
+	// Run the main agent/environment interaction loop
+	Session session(options, agent, env, &std::cout);
+    std::cout << "starting agent/environment interaction loop...\n";
+	while (session.step());
+	session.finish();
 
 	return 0;
 }
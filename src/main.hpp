@@ -6,10 +6,6 @@
 #include <string>
 #include <vector>
 
-// Streams for logging (defined in main.cpp)
-extern std::ofstream verboseLog;
-extern std::ofstream compactLog;
-
 // symbols that can be predicted
 typedef bool symbol_t;
 
@@ -33,4 +29,25 @@ typedef unsigned long long timelimit_t;
 // the program's keyword/value option pairs
 typedef std::map<std::string, std::string> options_t;
 
+class Agent;
+class Environment;
+
+// Populate the 'options' map based on 'key=value' pairs from an input stream
+void processOptions(std::ifstream &in, options_t &options);
+
+// Populate the 'options' map from '--key=value' command line arguments
+void parseCmdOptions(int argc, char *argv[], options_t &options);
+
+// Set the default configuration values
+void setDefaultOptions(options_t &options);
+
+// Construct the configured environment, or NULL if it is unknown
+Environment *createEnvironment(options_t &options);
+
+// Construct the agent for a configuration (after its environment)
+Agent *createAgent(options_t &options);
+
+// If specified, load a pretrained model into the agent
+void loadModel(Agent &ai, options_t &options);
+
 #endif // __MAIN_HPP__
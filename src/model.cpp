@@ -0,0 +1,78 @@
+#include "model.hpp"
+
+#include "util.hpp"
+
+
+// update the model with each symbol of a list
+void Model::update(const symbol_list_t &symlist) {
+	for (symbol_list_t::const_iterator it = symlist.begin(); it != symlist.end(); ++it) {
+		update(*it);
+	}
+}
+
+
+// add a list of symbols to the history, without touching the model
+void Model::updateHistory(const symbol_list_t &symlist) {
+	for (symbol_list_t::const_iterator it = symlist.begin(); it != symlist.end(); ++it) {
+		updateHistory(*it);
+	}
+}
+
+
+// revert the n most recently observed symbols
+void Model::revert(size_t bits) {
+	for (size_t i = 0; i < bits; ++i) {
+		revert();
+	}
+}
+
+
+// the probability of observing a sequence of symbols next
+double Model::predict(const symbol_list_t &symlist) {
+	double prob = 1.0;
+	size_t updated = 0;
+	for (symbol_list_t::const_iterator it = symlist.begin(); it != symlist.end(); ++it) {
+		prob *= predict(*it);
+		update(*it);
+		++updated;
+	}
+	revert(updated);
+	return prob;
+}
+
+
+// generate a random symbol from the model's prediction and learn it
+symbol_t Model::genRandomSymbolAndUpdate(double &prob_zero) {
+	prob_zero = predict(false);
+	symbol_t sym = rand01() > prob_zero;
+	update(sym);
+	return sym;
+}
+
+
+// generate a specified number of random symbols distributed according to
+// the model and update the model with the newly generated bits
+void Model::genRandomSymbolsAndUpdate(symbol_list_t &symbols, size_t bits) {
+	for (size_t i = 0; i < bits; i++) {
+		symbols.push_back(genRandomSymbolAndUpdate());
+	}
+}
+
+
+// generate a specified number of random symbols
+// distributed according to the model
+void Model::genRandomSymbols(symbol_list_t &symbols, size_t bits) {
+
+	genRandomSymbolsAndUpdate(symbols, bits);
+
+	// restore the model to it's original state
+	revert(bits);
+}
+
+
+// generate a specified number of rollout symbols
+void Model::genRolloutSymbols(symbol_list_t &symbols, size_t bits) {
+	for (size_t i = 0; i < bits; i++) {
+		symbols.push_back(genRolloutSymbol());
+	}
+}
@@ -0,0 +1,85 @@
+#ifndef __MODEL_HPP__
+#define __MODEL_HPP__
+
+#include <deque>
+#include <iostream>
+#include <stdint.h>
+
+#include "main.hpp"
+
+// stores symbol occurrence counts
+typedef unsigned int count_t;
+
+// stores the agent's history in terms of primitive symbols
+typedef std::deque<symbol_t> history_t;
+
+// A sequential predictor of the binary symbols making up the agent's history.
+// The agent's beliefs about its environment are held in a Model; the context
+// tree is one implementation.
+class Model {
+
+public:
+
+	virtual ~Model(void) { }
+
+	// create an independent copy of the model
+	virtual Model *fork(void) const = 0;
+
+	// clear the model and its history
+	virtual void clear(void) = 0;
+
+	// update the model with a new binary symbol, and add it to the history
+	virtual void update(symbol_t sym) = 0;
+	void update(const symbol_list_t &symlist);
+
+	// add symbols to the history without updating the model
+	virtual void updateHistory(symbol_t sym) = 0;
+	void updateHistory(const symbol_list_t &symlist);
+
+	// removes the most recently observed symbol from the model
+	virtual void revert(void) = 0;
+	// removes n most recently observed symbols from the model
+	void revert(size_t bits);
+
+	// shrinks the history down by n bits without changing the model
+	virtual void revertHistory(size_t bits) = 0;
+
+	// the estimated probability of observing a particular symbol or sequence
+	virtual double predict(symbol_t sym) = 0;
+	double predict(const symbol_list_t &symlist);
+
+	// generate a single random symbol distributed according to the model
+	// and update the model with it, also giving the probability the model
+	// assigned to a 0
+	symbol_t genRandomSymbolAndUpdate(void) { double p; return genRandomSymbolAndUpdate(p); }
+	virtual symbol_t genRandomSymbolAndUpdate(double &prob_zero);
+
+	// generate a specified number of random symbols distributed according to
+	// the model, with and without updating the model with them
+	void genRandomSymbolsAndUpdate(symbol_list_t &symbols, size_t bits);
+	void genRandomSymbols(symbol_list_t &symbols, size_t bits);
+
+	// generate a random symbol for a rollout and add it to the history. By
+	// default this is genRandomSymbolAndUpdate(), but models may sample from
+	// a cheaper approximation and leave their statistics untouched, in which
+	// case revertRollout() only shrinks the history.
+	virtual symbol_t genRolloutSymbol(void) { return genRandomSymbolAndUpdate(); }
+	void genRolloutSymbols(symbol_list_t &symbols, size_t bits);
+
+	// removes the n most recent symbols generated by genRolloutSymbol()
+	virtual void revertRollout(size_t bits) { revert(bits); }
+
+	// the size of the stored history
+	virtual size_t historySize(void) const = 0;
+
+	// a hash of the context the model predicts the next symbol from, equal
+	// for equal contexts whatever history led to them
+	virtual uint64_t contextHash(void) const = 0;
+
+	// write/load the model to/from a stream
+	virtual void write(std::ostream &out) = 0;
+	virtual void read(std::istream &in) = 0;
+};
+
+
+#endif // __MODEL_HPP__
@@ -0,0 +1,219 @@
+#include "ngram.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+#include "util.hpp"
+
+
+// create a model over contexts of 'order' symbols
+NGramModel::NGramModel(size_t order, unsigned int table_bits) :
+	m_history_base(0),
+	m_order(order),
+	m_context(0),
+	m_mask(order >= 64 ? ~0ULL : (1ULL << order) - 1),
+	m_shift(64 - table_bits),
+	m_size(size_t(1) << table_bits),
+	m_table(NULL)
+{
+	assert(order > 0 && order <= 64);
+	assert(table_bits > 0 && table_bits < 64);
+
+	clear();
+}
+
+
+NGramModel::~NGramModel(void) {
+	release(m_table);
+}
+
+
+// share a model's counts, keeping only the part of its history needed as
+// context
+NGramModel::NGramModel(const NGramModel &other) :
+	m_order(other.m_order),
+	m_context(other.m_context),
+	m_mask(other.m_mask),
+	m_shift(other.m_shift),
+	m_size(other.m_size),
+	m_table(other.m_table)
+{
+	++m_table->refs;
+	size_t keep = std::min(m_order, other.m_history.size());
+	m_history.assign(other.m_history.end() - keep, other.m_history.end());
+	m_history_base = other.historySize() - keep;
+}
+
+
+// create an independent copy of the model
+NGramModel *NGramModel::fork(void) const {
+	return new NGramModel(*this);
+}
+
+
+// drop a reference to a page, deleting it once it is unreferenced. A page
+// with a single reference can only be reached through its owner, so the
+// atomic decrement is only needed for shared pages.
+void NGramModel::release(page_t *page) {
+	if (page->refs.load(std::memory_order_acquire) == 1 || --page->refs == 0) {
+		delete page;
+	}
+}
+
+
+// drop a reference to a table, and to its pages once it is unreferenced
+void NGramModel::release(table_t *table) {
+	if (table->refs.load(std::memory_order_acquire) == 1 || --table->refs == 0) {
+		for (size_t i = 0; i < table->pages.size(); i++) {
+			release(table->pages[i]);
+		}
+		delete table;
+	}
+}
+
+
+// The entry at an index, copying the list of pages and then the entry's
+// page first if they are shared with a fork
+NGramModel::counts_t &NGramModel::ownEntry(size_t i) {
+	if (m_table->refs.load(std::memory_order_acquire) > 1) {
+		table_t *copy = new table_t();
+		copy->refs = 1;
+		copy->pages = m_table->pages;
+		for (size_t p = 0; p < copy->pages.size(); p++) {
+			++copy->pages[p]->refs;
+		}
+		release(m_table);
+		m_table = copy;
+	}
+	page_t *&page = m_table->pages[i >> page_bits];
+	if (page->refs.load(std::memory_order_acquire) > 1) {
+		page_t *copy = new page_t();
+		copy->refs = 1;
+		std::copy(page->counts, page->counts + (1 << page_bits), copy->counts);
+		release(page);
+		page = copy;
+	}
+	return page->counts[i & ((1 << page_bits) - 1)];
+}
+
+
+// replace the table by one of empty pages
+void NGramModel::emptyTable(void) {
+	if (m_table != NULL) release(m_table);
+	m_table = new table_t();
+	m_table->refs = 1;
+	// a table smaller than a page uses the start of one
+	m_table->pages.resize(std::max<size_t>(m_size >> page_bits, 1));
+	for (size_t i = 0; i < m_table->pages.size(); i++) {
+		m_table->pages[i] = new page_t();
+		m_table->pages[i]->refs = 1;
+	}
+}
+
+
+// clear the model and its history
+void NGramModel::clear(void) {
+	emptyTable();
+
+	// Create a fictional history of 'order' number of 0s.
+	m_history.assign(m_order, false);
+	m_history_base = 0;
+	m_context = 0;
+}
+
+
+// update the counts of the current context with a new binary symbol
+void NGramModel::update(symbol_t sym) {
+	++ownEntry(slot()).count[sym];
+	updateHistory(sym);
+}
+
+
+// add a symbol to the history without updating the counts
+void NGramModel::updateHistory(symbol_t sym) {
+	m_history.push_back(sym);
+	m_context = ((m_context << 1) | sym) & m_mask;
+}
+
+
+// removes the most recently observed symbol from the model
+void NGramModel::revert(void) {
+	symbol_t sym = m_history.back();
+	popContext();
+
+	counts_t &c = ownEntry(slot());
+	assert(c.count[sym] > 0);
+	--c.count[sym];
+}
+
+
+// shrinks the history down by n bits without changing the counts
+void NGramModel::revertHistory(size_t bits) {
+	for (size_t i = 0; i < bits; ++i) {
+		popContext();
+	}
+}
+
+
+// recompute the context after removing the most recent history symbol
+void NGramModel::popContext(void) {
+	// Forks only keep enough history to revert their own updates
+	assert(m_history.size() > m_order);
+
+	m_history.pop_back();
+	unsigned long long oldest = m_history[m_history.size() - m_order];
+	m_context = (m_context >> 1) | (oldest << (m_order - 1));
+}
+
+
+// the KT estimated probability of observing a particular symbol next
+double NGramModel::predict(symbol_t sym) {
+	const counts_t &c = entry(slot());
+	return (c.count[sym] + 0.5) / (c.count[false] + c.count[true] + 1.0);
+}
+
+
+// write the model to a stream: its order and table size, the history and
+// the non-empty table entries
+void NGramModel::write(std::ostream &out) {
+	out << m_order << " " << (64 - m_shift) << std::endl;
+	for (history_t::iterator it = m_history.begin(); it != m_history.end(); ++it) {
+		out << (*it);
+	}
+	out << std::endl;
+
+	for (size_t i = 0; i < m_size; ++i) {
+		const counts_t &c = entry(i);
+		if (c.count[false] || c.count[true]) {
+			out << i << " " << c.count[false] << " " << c.count[true] << " ";
+		}
+	}
+	out << m_size << std::endl;
+}
+
+
+// load the model from a stream, which must match its order and table size
+void NGramModel::read(std::istream &in) {
+	size_t order;
+	unsigned int table_bits;
+	in >> order >> table_bits;
+	if (order != m_order || table_bits != 64 - m_shift) {
+		in.setstate(std::ios::failbit);
+		return;
+	}
+
+	in.get(); //read the next character out of the way
+	m_history.clear();
+	m_history_base = 0;
+	m_context = 0;
+	for (char c = in.get(); in.good() && c != '\n'; c = in.get()) {
+		updateHistory(c == '1');
+	}
+
+	emptyTable();
+	size_t i;
+	while (in >> i && i < m_size) {
+		counts_t &c = ownEntry(i);
+		in >> c.count[false] >> c.count[true];
+	}
+}
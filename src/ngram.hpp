@@ -0,0 +1,127 @@
+#ifndef __NGRAM_HPP__
+#define __NGRAM_HPP__
+
+#include <deque>
+#include <atomic>
+#include <iostream>
+#include <vector>
+
+#include "main.hpp"
+#include "model.hpp"
+
+// A fixed-order context counting model. The most recent 'order' history
+// symbols are hashed into a table of symbol counts, and the next symbol is
+// predicted by the KT estimate of the counts stored for its context. Updates
+// and predictions take constant time, at the cost of ignoring longer contexts
+// and of sharing counts between contexts that collide in the table. The
+// table is split into pages, which forked models share until either of them
+// modifies one.
+class NGramModel : public Model {
+
+public:
+
+	// create a model over contexts of 'order' symbols (at most 64), hashed
+	// into a table of 2^table_bits entries
+	NGramModel(size_t order, unsigned int table_bits);
+
+	virtual ~NGramModel(void);
+
+	// create an independent copy of the model, which cannot be reverted past
+	// the point it was forked at. The copy shares the table with this model,
+	// so forking takes constant time regardless of its size.
+	virtual NGramModel *fork(void) const;
+
+	// clear the model and its history
+	virtual void clear(void);
+
+	using Model::update;
+	using Model::updateHistory;
+	using Model::revert;
+	using Model::predict;
+
+	// update the counts of the current context with a new binary symbol
+	virtual void update(symbol_t sym);
+
+	// add a symbol to the history without updating the counts
+	virtual void updateHistory(symbol_t sym);
+
+	// removes the most recently observed symbol from the model
+	virtual void revert(void);
+
+	// shrinks the history down by n bits without changing the counts
+	virtual void revertHistory(size_t bits);
+
+	// the KT estimated probability of observing a particular symbol next
+	virtual double predict(symbol_t sym);
+
+	// the size of the stored history
+	virtual size_t historySize(void) const { return m_history_base + m_history.size(); }
+
+	// the context is the last 'order' symbols, held as an integer
+	virtual uint64_t contextHash(void) const { return m_context; }
+
+	// the number of context symbols
+	size_t order(void) const { return m_order; }
+
+	// write/load the model to/from a stream
+	virtual void write(std::ostream &out);
+	virtual void read(std::istream &in);
+
+private:
+
+	// fork a model (see fork())
+	NGramModel(const NGramModel &other);
+
+	// models are forked, never assigned
+	NGramModel &operator=(const NGramModel &other);
+
+	// symbol counts of a context
+	struct counts_t {
+		count_t count[2];
+	};
+
+	// A page of the table, and the table as a list of pages. Both count the
+	// models and tables referring to them, and are copied by a model about
+	// to modify them while they are shared.
+	static const unsigned int page_bits = 10;
+	struct page_t {
+		std::atomic<unsigned int> refs;
+		counts_t counts[1 << page_bits];
+	};
+	struct table_t {
+		std::atomic<unsigned int> refs;
+		std::vector<page_t *> pages;
+	};
+
+	// drop a reference to a page or table, deleting it once unreferenced
+	static void release(page_t *page);
+	static void release(table_t *table);
+
+	// the index of the current context's entry
+	size_t slot(void) const { return (m_context * 0x9E3779B97F4A7C15ULL) >> m_shift; }
+
+	// the entry at an index, to read, or to modify after copying its page
+	// if it is shared with a fork
+	const counts_t &entry(size_t i) const {
+		return m_table->pages[i >> page_bits]->counts[i & ((1 << page_bits) - 1)];
+	}
+	counts_t &ownEntry(size_t i);
+
+	// replace the table by one of empty pages
+	void emptyTable(void);
+
+	// recompute the context after the most recent history symbol was removed
+	void popContext(void);
+
+	history_t m_history;           // the agent's history
+	size_t m_history_base;         // history symbols dropped by fork()
+	size_t m_order;                // the number of context symbols
+	unsigned long long m_context;  // the most recent 'order' symbols
+	unsigned long long m_mask;     // mask of the 'order' context bits
+	unsigned int m_shift;          // hash shift selecting a table entry
+	size_t m_size;                 // the number of table entries
+	table_t *m_table;              // hashed symbol counts
+};
+
+
+#endif // __NGRAM_HPP__
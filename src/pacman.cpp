@@ -69,65 +69,167 @@ vector< vector<int> > Pacman::genAdjList(void) {
 }
 
 
-/** Use BFS to find a shortest path between two points.
+// First moves along shortest paths, and the moves out of each location,
+// used for ghost movement
+const vector<unsigned char> Pacman::nextMove = Pacman::genNextMove();
+const vector< vector<action_t> > Pacman::openMoves = Pacman::genOpenMoves();
+
+/** Use BFS from every location to find the first move on a shortest path
+    to every other location. The maze is static, so this is done once.
+    Neighbours are visited in adjacency list order, so the paths are the
+    ones a BFS between the two points would find. A location whose BFS
+    rediscovers it from its first neighbour moves to that neighbour when
+    asked for a path to itself.
+    @return vector First move from src to dest at (src * size * size) + dest
+*/
+vector<unsigned char> Pacman::genNextMove(void) {
+    const int cells = size * size;
+    vector<unsigned char> moves(cells * cells, m_move_down);
+    vector<int> first(cells);
+    vector<int> queue(cells);
+
+    for (int s = 0; s < cells; s++) {
+        if (adjList[s].empty()) continue;
+        fill(first.begin(), first.end(), -1);
+
+        // The first hop of each location is inherited from its parent
+        int head = 0, tail = 0;
+        queue[tail++] = s;
+        while (head < tail) {
+            int v = queue[head++];
+            const vector<int> &neighbours = adjList[v];
+            for (unsigned int i = 0; i < neighbours.size(); i++) {
+                int n = neighbours[i];
+                if (first[n] >= 0) continue;
+                first[n] = (v == s) ? n : first[v];
+                if (n != s) queue[tail++] = n;
+            }
+        }
+
+        // Map each first hop to an action
+        for (int d = 0; d < cells; d++) {
+            int n = first[d];
+            if (n < 0) continue;
+            unsigned char a;
+            if (n == (s - 1)) a = m_move_left;
+            else if (n == (s + 1)) a = m_move_right;
+            else if (n < s) a = m_move_up;
+            else a = m_move_down;
+            moves[s * cells + d] = a;
+        }
+    }
+
+    return moves;
+}
+
+// Generate the moves out of each location that do not run into a wall
+vector< vector<action_t> > Pacman::genOpenMoves(void) {
+    vector< vector<action_t> > moves;
+
+    for (int i = 0; i < size; i++) {
+        for (int j = 0; j < size; j++) {
+            vector<action_t> tmpList;
+            if ((j > 0) && !maze[i][j - 1]) {
+                tmpList.push_back((action_t) m_move_left);
+            }
+            if ((j < size - 1) && !maze[i][j + 1]) {
+                tmpList.push_back((action_t) m_move_right);
+            }
+            if ((i > 0) && !maze[i - 1][j]) {
+                tmpList.push_back((action_t) m_move_up);
+            }
+            if ((i < size - 1) && !maze[i + 1][j]) {
+                tmpList.push_back((action_t) m_move_down);
+            }
+            moves.push_back(tmpList);
+        }
+    }
+
+    return moves;
+}
+
+
+/** The first move on a shortest path between two points, looked up in
+    the table built by genNextMove().
     Assumes only movement in the four cardinal directions are possible.
     @param src Start point
     @param dest Destination point
     @return action_t Corresponding to best move from src
 */
 action_t Pacman::shortestMove(point &src, point &dest) {
-    // Standard queue for unvisited nodes
-    queue<int> q;
-    // Integer representations of src and dest
     int d = (dest.row * size) + dest.col;
     int s = (src.row * size) + src.col;
-    q.push(s);
-    // Keep track of visited vertices, also serves to find path
-    int parent[adjList.size()];
-    // Initialise all elements to -1
-    fill_n(parent, adjList.size(), -1);
-
-    // Main BFS loop
-    int v, n;
-    while (!q.empty()) {
-        // Get first element
-        v = q.front();
-        q.pop();
-
-        // Check neighbours
-        vector<int> neighbours = adjList.at(v);
-        for (unsigned int i = 0; i < neighbours.size(); i++) {
-            n = neighbours.at(i);
-            // Update path
-            if (parent[n] < 0) {
-                parent[n] = v;
-                q.push(n);
-            }
+    assert(!adjList[s].empty() && !adjList[d].empty());
+    return nextMove[s * size * size + d];
+}
+
+
+// Sets of locations used to compute observations
+const Pacman::bitboard Pacman::wallBoard = Pacman::genWallBoard();
+const vector<Pacman::bitboard> Pacman::rays = Pacman::genRays();
+const vector<Pacman::bitboard> Pacman::scans = Pacman::genScans();
+
+// Generate the set of wall locations
+Pacman::bitboard Pacman::genWallBoard(void) {
+    bitboard walls = bitboard();
+    for (int i = 0; i < size; i++) {
+        for (int j = 0; j < size; j++) {
+            if (maze[i][j]) walls.set((i * size) + j);
         }
-        // Check if we have reached dest
-        if (parent[d] >= 0) break;
     }
+    return walls;
+}
 
-    // Ensure that we have found a path to dest
-    n = parent[d];
-    assert(n >= 0);
+// Generate, for every location and direction, the locations from there
+// (inclusive) up to the first wall or the edge of the maze. An entity is
+// in line of sight if its location is in the set.
+vector<Pacman::bitboard> Pacman::genRays(void) {
+    vector<bitboard> sets(size * size * m_num_actions, bitboard());
+
+    for (int r = 0; r < size; r++) {
+        for (int c = 0; c < size; c++) {
+            bitboard *ray = &sets[((r * size) + c) * m_num_actions];
+            for (int i = c; i >= 0 && !maze[r][i]; --i) {
+                ray[m_move_left].set((r * size) + i);
+            }
+            for (int i = c; i < size && !maze[r][i]; ++i) {
+                ray[m_move_right].set((r * size) + i);
+            }
+            for (int i = r; i >= 0 && !maze[i][c]; --i) {
+                ray[m_move_up].set((i * size) + c);
+            }
+            for (int i = r; i < size && !maze[i][c]; ++i) {
+                ray[m_move_down].set((i * size) + c);
+            }
+        }
+    }
+    return sets;
+}
 
-    // Get path
-    vector<int> path;
-    path.push_back(d);
-    while (n != s) {
-        path.push_back(n);
-        n = parent[n];
+// Generate, for every location and range up to max_scan, the locations
+// entityScan() looks at
+vector<Pacman::bitboard> Pacman::genScans(void) {
+    vector<bitboard> sets(size * size * (max_scan + 1), bitboard());
+
+    for (int r = 0; r < size; r++) {
+        for (int c = 0; c < size; c++) {
+            for (int range = 0; range <= max_scan; range++) {
+                bitboard &scan = sets[((r * size) + c) * (max_scan + 1) + range];
+                // Square of length "range" centered on the location
+                for (int i = r - range; i < r + range; i++) {
+                    for (int j = c - range; j < c + range; j++) {
+                        // Only locations within the maze
+                        if (i < 0 || i >= size) continue;
+                        if (j < 0 || j >= size) continue;
+                        // Discard corners (outside "range" in Manhattan distance)
+                        if (abs(i - r) + abs(j - c) > range) continue;
+                        scan.set((i * size) + j);
+                    }
+                }
+            }
+        }
     }
-    path.push_back(s);
-
-    // Get first move from src
-    n = path.at(path.size() - 2);
-    // Map this to an action
-    if (n == (s - 1)) return m_move_left;
-    else if (n == (s + 1)) return m_move_right;
-    else if (n < s) return m_move_up;
-    return m_move_down;
+    return sets;
 }
 
 
@@ -141,7 +243,7 @@ const Pacman::point Pacman::g_init[numGhosts] = {{7, 9}, {7, 10},{8, 9}, {8, 10}
 void Pacman::printWorld(void) {
     for (int i = 0; i < size; i++) {
         for (int j = 0; j < size; j++) {
-            switch (world[i][j]) {
+            switch (cellAt(i, j)) {
                 case e_empty    : cout << " "; break;
                 case e_wall     : cout << "\u2588"; break;
                 case e_food     : cout << "\u2022"; break;
@@ -163,7 +265,7 @@ void Pacman::printCurses(void) {
     addch('\n');
     for (int i = 0; i < size; i++) {
         for (int j = 0; j < size; j++) {
-            switch (world[i][j]) {
+            switch (cellAt(i, j)) {
                 case e_empty    : addch(' '); break;
                 case e_wall     : addch(ACS_CKBOARD); break;
                 case e_food     : addch(ACS_BULLET); break;
@@ -189,21 +291,44 @@ bool Pacman::powerActive(void) {
 
 // Update entity positions (Pacman and Ghosts)
 void Pacman::updateWorldPositions(void) {
-    world[pacman.row][pacman.col] = e_pacman;
+    // Pacman takes over its location
+    int p = (pacman.row * size) + pacman.col;
+    foodBoard.clear(p);
+    powerBoard.clear(p);
+    ghostBoard.clear(p);
     // Update ghosts
     for (int i = 0; i < numGhosts; i++) {
         // Check if ghost is idle
         if (ghostState[i] < 0) continue;
         // Otherwise, update position in world
-        int r = ghosts[i].row;
-        int c = ghosts[i].col;
-        if (entityAt(r, c, e_food)) {
-            world[r][c] = e_gf;
-        } else if (entityAt(r, c, e_power)) {
-            world[r][c] = e_gp;
-        } else {
-            world[r][c] = e_ghost;
-        }
+        ghostBoard.set((ghosts[i].row * size) + ghosts[i].col);
+    }
+}
+
+// The entity, or combination of entities, at a particular position
+int Pacman::cellAt(int row, int col) {
+    assert(row >= 0 && row < size);
+    assert(col >= 0 && col < size);
+    int i = (row * size) + col;
+    if (wallBoard.test(i)) return e_wall;
+    if (ghostBoard.test(i)) {
+        if (foodBoard.test(i)) return e_gf;
+        if (powerBoard.test(i)) return e_gp;
+        return e_ghost;
+    }
+    if (foodBoard.test(i)) return e_food;
+    if (powerBoard.test(i)) return e_power;
+    if (row == pacman.row && col == pacman.col) return e_pacman;
+    return e_empty;
+}
+
+// The locations of an entity (walls, food, power pellets or ghosts)
+const Pacman::bitboard &Pacman::entityBoard(const int ent) {
+    switch (ent) {
+        case e_wall     : return wallBoard;
+        case e_food     : return foodBoard;
+        case e_power    : return powerBoard;
+        default         : assert(ent == e_ghost); return ghostBoard;
     }
 }
 
@@ -211,13 +336,8 @@ void Pacman::updateWorldPositions(void) {
 bool Pacman::entityAt(int row, int col, const int ent) {
     assert(row >= 0 && row < size);
     assert(col >= 0 && col < size);
-    // Get object at p
-    int actual = world[row][col];
-    if (actual == ent) return true;
-    else if (ent == e_ghost) return (actual == e_gf || actual == e_gp);
-    else if (ent == e_food) return (actual == e_gf);
-    else if (ent == e_power) return (actual == e_gp);
-    return false;
+    if (ent == e_empty || ent == e_pacman) return cellAt(row, col) == ent;
+    return entityBoard(ent).test((row * size) + col);
 }
 
 // "Eat ghosts" at a particular position p
@@ -235,19 +355,9 @@ void Pacman::eatGhosts(point &p) {
 
 // Check if a particular entity exists within "range" units from p 
 bool Pacman::entityScan(point &p, int range, const int ent) {
-    // Start with square of length "range" centered on p
-    for (int i = p.row - range; i < p.row + range; i++) {
-        for (int j = p.col - range; j < p.col + range; j++) {
-            // Only check locations within the maze
-            if (i < 0 || i >= size) continue;
-            if (j < 0 || j >= size) continue;
-            // Discard corners (outside "range" in Manhattan distance)
-            if (abs(i - p.row) + abs(j - p.col) > range) continue;
-            // Check if the required entitiy is at this point
-            if (entityAt(i, j, ent)) return true;
-        }
-    }
-    return false;
+    assert(range >= 0 && range <= max_scan);
+    int i = (p.row * size) + p.col;
+    return scans[i * (max_scan + 1) + range].meets(entityBoard(ent));
 }
 
 
@@ -259,34 +369,8 @@ bool Pacman::entityScan(point &p, int range, const int ent) {
 */
 bool Pacman::lineOfSight(point &p, action_t dir, const int ent) {
     assert(dir < m_num_actions);
-    switch (dir) {
-        case m_move_left :
-            for (int i = p.col; i >= 0; --i) {
-                if (world[p.row][i] == e_wall) return false;
-                if (entityAt(p.row, i, ent)) return true;
-            }
-            break;
-        case m_move_right :
-            for (int i = p.col; i < size; ++i) {
-                if (world[p.row][i] == e_wall) return false;
-                if (entityAt(p.row, i, ent)) return true;
-            }
-            break;
-        case m_move_up :
-            for (int i = p.row; i >= 0; --i) {
-                if (world[i][p.col] == e_wall) return false;
-                if (entityAt(i, p.col, ent)) return true;
-            }
-            break;
-        case m_move_down :
-            for (int i = p.row; i < size; ++i) {
-                if (world[i][p.col] == e_wall) return false;
-                if (entityAt(i, p.col, ent)) return true;
-            }
-            break;
-        default : return 0;
-    };
-    return 0;
+    int i = (p.row * size) + p.col;
+    return rays[i * m_num_actions + dir].meets(entityBoard(ent));
 }
 
 // Output a percept corresponding to pacman's current observation
@@ -339,7 +423,8 @@ percept_t Pacman::genObservation(void) {
 // Should be called immediately after pacman moves.
 // Should also be called after moving ghosts.
 int Pacman::genReward(void) {
-    int value = world[pacman.row][pacman.col];
+    int p = (pacman.row * size) + pacman.col;
+    int value = cellAt(pacman.row, pacman.col);
     int reward = 0;
 
     // note e_wall should never occur
@@ -348,12 +433,12 @@ int Pacman::genReward(void) {
         case e_food :
             reward += m_reward_food;
             // delete food (do not add pacman here yet)
-            world[pacman.row][pacman.col] = e_empty;
+            foodBoard.clear(p);
             --numFood;
             break;
         case e_power :
             powerP = init_power_length;
-            world[pacman.row][pacman.col] = e_empty;
+            powerBoard.clear(p);
             break;
         case e_gf :
             // If under power pill effects, eat food
@@ -394,19 +479,7 @@ void Pacman::moveGhost(int index) {
     } else {
         // Make a random move
         // Get available movements
-        vector<action_t> actions;
-        if ((curCol > 0) && !maze[curRow][curCol - 1]) {
-            actions.push_back((action_t) m_move_left);
-        }
-        if ((curCol < size - 1) && !maze[curRow][curCol + 1]) {
-            actions.push_back((action_t) m_move_right);
-        }
-        if ((curRow > 0) && !maze[curRow - 1][curCol]) {
-            actions.push_back((action_t) m_move_up);
-        }
-        if ((curRow < size - 1) && !maze[curRow + 1][curCol]) {
-            actions.push_back((action_t) m_move_down);
-        }
+        const vector<action_t> &actions = openMoves[curRow * size + curCol];
 
         // Randomly pick a move
         a = actions.at(randRange((unsigned int) actions.size()));
@@ -421,14 +494,8 @@ void Pacman::moveGhost(int index) {
         default : break;
     };
 
-    // Clear previous square
-    switch (world[curRow][curCol]) {
-        case e_food : world[curRow][curCol] = e_food; break;
-        case e_gf : world[curRow][curCol] = e_food; break;
-        case e_power : world[curRow][curCol] = e_power; break;
-        case e_gp : world[curRow][curCol] = e_power; break;
-        default : world[curRow][curCol] = e_empty; break;
-    };
+    // Clear previous square, leaving any food or power pellet
+    ghostBoard.clear((curRow * size) + curCol);
 }
 
 void Pacman::reset(void) {
@@ -436,12 +503,10 @@ void Pacman::reset(void) {
     endState = false;
     numFood = 0;
 
-    // Initial world configuration (walls)
-    for (int i = 0; i < size; i++) {
-        for (int j = 0; j < size; j++) {
-            world[i][j] = maze[i][j];
-        }
-    }
+    // Initial world configuration (walls only)
+    foodBoard = bitboard();
+    powerBoard = bitboard();
+    ghostBoard = bitboard();
     // Initial locations for pacman and ghosts
     pacman = (point) pacman_init;
     ghosts[0] = g_init[0];
@@ -465,21 +530,21 @@ void Pacman::reset(void) {
     powerP = 0;
 
     // Place power pellets
-    world[1][1] = e_power;
-    world[1][17] = e_power;
-    world[14][1] = e_power;
-    world[14][17] = e_power;
+    powerBoard.set((1 * size) + 1);
+    powerBoard.set((1 * size) + 17);
+    powerBoard.set((14 * size) + 1);
+    powerBoard.set((14 * size) + 17);
 
     updateWorldPositions();
 
     // Place food in empty locations with 0.5 probability
     for (int i = 0; i < size; i++) {
         for (int j = 0; j < size; j++) {
-            int entity = world[i][j];
+            int entity = cellAt(i, j);
             if (entity == e_empty) {
                 if (rand01() < 0.5) {
                     ++numFood;
-                    world[i][j] = e_food;
+                    foodBoard.set((i * size) + j);
                 }
             }
         }
@@ -506,7 +571,7 @@ void Pacman::performAction(action_t action) {
         case m_move_left :
             newcol = (pacman.col == 0) ? size - 1 : pacman.col - 1;
             if (!maze[pacman.row][newcol]) {
-                world[pacman.row][pacman.col] = e_empty;
+                ghostBoard.clear((pacman.row * size) + pacman.col);
                 pacman.col = newcol;
                 reward += genReward();
             } else reward -= m_reward_wall;
@@ -514,7 +579,7 @@ void Pacman::performAction(action_t action) {
         case m_move_right :
             newcol = (pacman.col == size - 1) ? 0 : pacman.col + 1;
             if (!maze[pacman.row][newcol]) {
-                world[pacman.row][pacman.col] = e_empty;
+                ghostBoard.clear((pacman.row * size) + pacman.col);
                 pacman.col = newcol;
                 reward += genReward();
             } else reward -= m_reward_wall;
@@ -523,7 +588,7 @@ void Pacman::performAction(action_t action) {
         case m_move_up :
             newrow = pacman.row - 1;
             if (newrow >= 0 && !maze[newrow][pacman.col]) {
-                world[pacman.row][pacman.col] = e_empty;
+                ghostBoard.clear((pacman.row * size) + pacman.col);
                 --pacman.row;
                 reward += genReward();
             } else reward -= m_reward_wall;
@@ -531,7 +596,7 @@ void Pacman::performAction(action_t action) {
         case m_move_down :
             newrow = pacman.row + 1;
             if (newrow < size && !maze[newrow][pacman.col]) {
-                world[pacman.row][pacman.col] = e_empty;
+                ghostBoard.clear((pacman.row * size) + pacman.col);
                 ++pacman.row;
                 reward += genReward();
             } else reward -= m_reward_wall;
@@ -1,6 +1,7 @@
 #include "predict.hpp"
 
 #include <cassert>
+#include <algorithm>
 #include <cmath>
 #include <errno.h>
 #include "util.hpp"
@@ -9,9 +10,20 @@
 // compute log(0.5)
 static const double log_half = log(0.5);
 
+// the multiplicative inverse of an odd number modulo 2^64, by Newton's
+// iteration, each step of which doubles the number of correct bits
+static uint64_t inverse(uint64_t x) {
+    uint64_t y = x;
+    for (int i = 0; i < 5; i++) y *= 2 - x * y;
+    return y;
+}
+
+const uint64_t ContextTree::hash_base_inverse = inverse(ContextTree::hash_base);
+
 CTNode::CTNode(void) :
     m_log_prob_est(0.0),
-    m_log_prob_weighted(0.0){
+    m_log_prob_weighted(0.0),
+    m_refs(1) {
 
     m_count[0] = 0;
     m_count[1] = 0;
@@ -20,9 +32,32 @@ CTNode::CTNode(void) :
 }
 
 
+CTNode::CTNode(const CTNode &other) :
+    m_log_prob_est(other.m_log_prob_est),
+    m_log_prob_weighted(other.m_log_prob_weighted),
+    m_refs(1) {
+
+    for (int i = 0; i < 2; i++) {
+        m_count[i] = other.m_count[i];
+        m_child[i] = other.m_child[i];
+        if (m_child[i]) ++m_child[i]->m_refs;
+    }
+}
+
+
 CTNode::~CTNode(void) {
-    if (m_child[0]) delete m_child[0];
-    if (m_child[1]) delete m_child[1];
+    if (m_child[0]) release(m_child[0]);
+    if (m_child[1]) release(m_child[1]);
+}
+
+
+// drop a reference to a node, deleting it once it is unreferenced
+void CTNode::release(CTNode *node) {
+    // a node with a single reference can only be reached through its owner,
+    // so the atomic decrement is only needed for shared nodes
+    if (node->m_refs.load(std::memory_order_acquire) == 1 || --node->m_refs == 0) {
+        delete node;
+    }
 }
 
 
@@ -80,183 +115,185 @@ void CTNode::updateLogProbWeighted() {
 // create a context tree of specified maximum depth
 ContextTree::ContextTree(size_t depth) :
     m_root(new CTNode()),
-    m_depth(depth)
+    m_depth(depth),
+    m_history_base(0),
+    m_rollout_depth(0),
+    m_path(depth)
 {
     // Create a fictional history of 'depth' number of 0s.
     for (size_t i = 0; i < depth; ++i) {
         m_history.push_back(false);
     }
+    rehash();
+}
+
+
+// fork a context tree, sharing all of its nodes
+ContextTree::ContextTree(const ContextTree &other) :
+    m_root(other.m_root),
+    m_depth(other.m_depth),
+    m_rollout_depth(other.m_rollout_depth),
+    m_path(other.m_depth)
+{
+    ++m_root->m_refs;
+
+    // Only the most recent 'depth' symbols are needed as context.
+    size_t keep = std::min(m_depth, other.m_history.size());
+    m_history.assign(other.m_history.end() - keep, other.m_history.end());
+    m_history_base = other.historySize() - keep;
+    m_hash = other.m_hash;
+    m_hash_out = other.m_hash_out;
 }
 
 
 ContextTree::~ContextTree(void) {
-    if (m_root) delete m_root;
+    if (m_root) CTNode::release(m_root);
+}
+
+
+// create an independent copy of the context tree that shares its nodes
+ContextTree *ContextTree::fork(void) const {
+    return new ContextTree(*this);
 }
 
 
 // clear the entire context tree
 void ContextTree::clear(void) {
     m_history.clear();
+    m_history_base = 0;
     // Create a fictional history of 'depth' number of 0s.
     for (size_t i = 0; i < m_depth; ++i) {
         m_history.push_back(false);
     }
-    if (m_root) delete m_root;
+    rehash();
+    if (m_root) CTNode::release(m_root);
     m_root = new CTNode();
 }
 
 // Update the CTW with the given symbol, and add that symbol to the history.
 void ContextTree::update(symbol_t sym) {
-    
-    // Path based on context
-    CTNode *context_nodes[m_depth];
+    updatePath(&m_path[0], m_depth, sym);
+}
 
-	// Traverse tree to appropriate leaf.
-    context_nodes[0] = m_root;
-    history_t::iterator hist_it = m_history.end() - 1;
-    for (size_t n = 1; n < m_depth; ++n, --hist_it) {
-        symbol_t context_symbol = *hist_it;
-        // Create children as they are needed.
-        if (context_nodes[n-1]->m_child[context_symbol] == NULL) {
-            context_nodes[n-1]->m_child[context_symbol] = new CTNode();
-        }
-        context_nodes[n] = context_nodes[n-1]->m_child[context_symbol];
-    }
 
-    // Update probabilities from leaf back to root
-    for (int n = m_depth - 1; n >= 0; --n) {
-        // Update the log probabilities, after seeing sym.
-        // Local KT estimate update, in log form.
-        context_nodes[n]->m_log_prob_est = context_nodes[n]->m_log_prob_est
-                                          + context_nodes[n]->logKTMul(sym);
-        // Update a / b.
-        ++(context_nodes[n]->m_count[sym]);
-
-        // Update weighted probabilities
-        if ((unsigned int) n == m_depth - 1) {
-            // Leaf node
-            context_nodes[n]->m_log_prob_weighted =
-                    context_nodes[n]->logProbEstimated();
-        } else {
-            context_nodes[n]->updateLogProbWeighted();
-        }
-    }
-    
-    m_history.push_back(sym);
+// removes the most recently observed symbol from the context tree
+void ContextTree::revert(void) {
+    revertPath(&m_path[0], m_depth);
 }
 
-
-void ContextTree::update(const symbol_list_t &symlist) {
-    // Call update, on each symbol in this list.
-    for (symbol_list_t::const_iterator it = symlist.begin(); it != symlist.end(); ++it) {
-        update(*it);
+//revert last bits in history without changing the ct
+void ContextTree::revertHistory(size_t bits) {
+    assert(bits <= m_history.size());
+    for (unsigned int i = 0; i < bits; ++i) {
+        popHistory();
     }
 }
 
-// updates the history symbols, without touching the context tree
-void ContextTree::updateHistory(const symbol_list_t &symlist) {
-    for (size_t i=0; i < symlist.size(); i++) {
-        m_history.push_back(symlist[i]);
+
+
+// recompute the context hash from the last 'depth' history symbols
+void ContextTree::rehash(void) {
+    m_hash_out = 1;
+    m_hash = 0;
+    size_t size = m_history.size();
+    for (size_t i = 0; i < m_depth; ++i) {
+        if (i < size) m_hash += m_hash_out * m_history[size - 1 - i];
+        m_hash_out *= hash_base;
     }
 }
 
 
-// removes the most recently observed symbol from the context tree
-void ContextTree::revert(void) {
-    
-    // Get latest symbol (to update counts) and remove from history
-    symbol_t latest_sym = m_history.back();
-    m_history.pop_back();
+// change the maximum depth of the context tree
+bool ContextTree::setDepth(size_t depth) {
+    m_depth = depth;
+    m_path.resize(depth);
+    rehash();
+    return true;
+}
 
-    // Path based on context
-    CTNode *context_nodes[m_depth];
-    // Symbols that are the context
-    symbol_t context_symbols[m_depth];
 
-    context_nodes[0] = m_root;
-    // Traverse tree to leaf
-    history_t::iterator hist_it = m_history.end() - 1;
-    for (size_t n = 1; n < m_depth; ++n, --hist_it) {
-        context_symbols[n] = *hist_it;
-        context_nodes[n] = context_nodes[n-1]->m_child[context_symbols[n]];
-    }
+// the probability of observing a particular symbol next
+double ContextTree::predict(symbol_t sym) {
+    double logJointProb = m_root->logProbWeighted();
+    update(sym);
+    double logJointWithSymbolProb = m_root->logProbWeighted();
+    revert();
 
-    // Update estimates
-    for (int n = m_depth - 1; n >= 0; --n) {
-        // Remove effects of last update
-        --context_nodes[n]->m_count[latest_sym];
-
-        // Delete node if it is no longer required
-        if (context_nodes[n]->visits() == 0) {
-            context_nodes[n-1]->m_child[context_symbols[n]] = NULL;
-            delete context_nodes[n];
-            continue;
-        }
-
-        context_nodes[n]->m_log_prob_est -= context_nodes[n]->logKTMul(latest_sym);
-
-        // Update weighted probabilities
-        if ((unsigned int) n == m_depth - 1) {
-            // Leaf node
-            context_nodes[n]->m_log_prob_weighted = context_nodes[n]->logProbEstimated();
-        } else {
-            context_nodes[n]->updateLogProbWeighted();
-        }
-    }
+    return exp(logJointWithSymbolProb - logJointProb);
 }
 
-//revert n bits in
-void ContextTree::revert(size_t bits){
-    for (unsigned int i = 0; i < bits; ++i) {
+
+// generate a single random symbol distributed according to the context tree
+// statistics and update the context tree with it
+symbol_t ContextTree::genRandomSymbolAndUpdate(double &prob_zero) {
+    double logJointProb = m_root->logProbWeighted();
+
+    //add '0' to history, get probability
+    update(false);
+    double logJointWithSymbolProb = m_root->logProbWeighted();
+
+    //calc probabilty that '0' follows
+    prob_zero = exp (logJointWithSymbolProb - logJointProb);
+
+    symbol_t sym = rand01() > prob_zero;
+
+    // Only revert the update of '0' if necessary.
+    if (sym) {
         revert();
+        update(sym);
     }
-}
 
-//revert last bits in history without changing the ct
-void ContextTree::revertHistory(size_t bits) {
-    assert(bits <= m_history.size());
-    for (unsigned int i = 0; i < bits; ++i) {
-        m_history.pop_back();
-    }
+    return sym;
 }
 
 
+// generate a random symbol for a rollout. When truncating, the probability of
+// a '0' is computed along the context path down to the rollout depth, where
+// the node is treated as a leaf and its KT estimate used. Each node above it
+// mixes its own KT estimate with the prediction of its child, weighted by
+// the posterior probability that the context ends at that node. The tree is
+// not updated, so this costs O(k) with a single exp() per node.
+symbol_t ContextTree::genRolloutSymbol(void) {
+    if (m_rollout_depth == 0 || m_rollout_depth >= m_depth) {
+        return genRandomSymbolAndUpdate();
+    }
 
-// generate a specified number of random symbols
-// distributed according to the context tree statistics
-void ContextTree::genRandomSymbols(symbol_list_t &symbols, size_t bits) {
+    // Walk down the context as far as the rollout depth or the first
+    // unvisited context.
+    CTNode **path = &m_path[0];
+    path[0] = m_root;
+    size_t n = 1;
+    history_t::iterator hist_it = m_history.end() - 1;
+    for ( ; n < m_rollout_depth; ++n, --hist_it) {
+        path[n] = path[n-1]->m_child[*hist_it];
+        if (path[n] == NULL) break;
+    }
 
-    genRandomSymbolsAndUpdate(symbols, bits);
+    // an unvisited context predicts either symbol equally
+    double prob_zero = 0.5;
+    if (n == m_rollout_depth) {
+        --n;
+        prob_zero = (path[n]->m_count[false] + 0.5) / (path[n]->visits() + 1.0);
+    }
+    while (n-- > 0) {
+        CTNode *node = path[n];
+        double w = exp(log_half + node->m_log_prob_est - node->m_log_prob_weighted);
+        double kt_zero = (node->m_count[false] + 0.5) / (node->visits() + 1.0);
+        prob_zero = w * kt_zero + (1.0 - w) * prob_zero;
+    }
 
-    // restore the context tree to it's original state
-    for (size_t i=0; i < bits; i++) revert();
+    symbol_t sym = rand01() > prob_zero;
+    pushHistory(sym);
+    return sym;
 }
 
 
-// generate a specified number of random symbols distributed according to
-// the context tree statistics and update the context tree with the newly
-// generated bits
-void ContextTree::genRandomSymbolsAndUpdate(symbol_list_t &symbols, size_t bits) {
-    for (size_t i=0; i < bits; i++) {
-
-        double logJointProb = m_root->logProbWeighted();
-        
-        //add '0' to history, get probability
-        update(false);
-        double logJointWithSymbolProb = m_root->logProbWeighted();
-        
-        //calc probabilty that '0' follows
-        double symbolCondProb = exp (logJointWithSymbolProb - logJointProb);
-        
-        symbol_t sym = rand01() > symbolCondProb;
-        
-        // Only revert the update of '0' if necessary.
-        if (sym) {
-            revert();
-            update(sym);
-        }
-        
-        symbols.push_back(sym);
+// removes the most recent rollout symbols
+void ContextTree::revertRollout(size_t bits) {
+    if (m_rollout_depth == 0 || m_rollout_depth >= m_depth) {
+        revert(bits);
+    } else {
+        revertHistory(bits);
     }
 }
 
@@ -323,18 +360,27 @@ std::ostream& operator<< (std::ostream &out, ContextTree &ct){
 
 //read context tree from stream
 std::istream& operator>> (std::istream &in, ContextTree &ct){
-    in >> ct.m_depth;
+    size_t depth;
+    in >> depth;
+    if (!ct.setDepth(depth)) {
+        in.setstate(std::ios::failbit);
+        return in;
+    }
     
     in.get(); //read the next character out of the way
     char c = in.get();
     
     ct.m_history.clear();
+    ct.m_history_base = 0;
     while(c != '\n'){
         ct.m_history.push_back(c == '1');
         c = in.get();
     }
+    ct.rehash();
     
-    //read nodes recursivly
+    //read nodes recursivly into a fresh root
+    CTNode::release(ct.m_root);
+    ct.m_root = new CTNode();
     in >> (*ct.m_root);
     
     return in;
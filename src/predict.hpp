@@ -1,20 +1,18 @@
 #ifndef __PREDICT_HPP__
 #define __PREDICT_HPP__
 
+#include <atomic>
+#include <cassert>
 #include <deque>
 #include <iostream>
+#include <vector>
 
 #include "main.hpp"
-
-// stores symbol occurrence counts
-typedef unsigned int count_t;
+#include "model.hpp"
 
 // holds context weights
 typedef double weight_t;
 
-// stores the agent's history in terms of primitive symbols
-typedef std::deque<symbol_t> history_t;
-
 class CTNode {
 	friend class ContextTree; // i.e. ContextTree can access private members of CTNode
 
@@ -34,15 +32,25 @@ public:
 	// number of descendants
 	size_t size(void) const;
 
+	// true if the node is referenced by more than one context tree
+	bool shared(void) const { return m_refs.load(std::memory_order_acquire) > 1; }
+
     //streaming operators to write/load data
     friend std::ostream& operator<< (std::ostream &out, CTNode &node);
     friend std::istream& operator>> (std::istream &in, CTNode &node);
+    friend std::istream& operator>> (std::istream &in, class ContextTree &ct);
 
 private:
 	CTNode(void);
 
+	// copy a node, sharing its children with the original
+	CTNode(const CTNode &other);
+
 	~CTNode(void);
 
+	// drop a reference to a node, deleting it once it is unreferenced
+	static void release(CTNode *node);
+
 	// compute the logarithm of the KT-estimator update multiplier
 	double logKTMul(symbol_t sym) const; // TODO: implement in predict.cpp
 
@@ -57,44 +65,58 @@ private:
     count_t m_count[2];  // a,b in CTW literature
     CTNode *m_child[2];
 
+    // number of parent nodes and trees referring to this node; nodes are
+    // shared between forked trees and copied before they are modified
+    std::atomic<unsigned int> m_refs;
 };
 
-class ContextTree {
+class ContextTree : public Model {
 public:
 
 	// create a context tree of specified maximum depth
 	ContextTree(size_t depth);
 
-	~ContextTree(void);
+	virtual ~ContextTree(void);
+
+	// create an independent copy of the context tree in constant time. The
+	// copy shares its nodes with this tree until either of them writes to
+	// them, and cannot be reverted past the point it was forked at.
+	virtual ContextTree *fork(void) const;
 
 	// clear the entire context tree
-	void clear(void);
+	virtual void clear(void);
+
+    using Model::update;
+    using Model::updateHistory;
+    using Model::revert;
+    using Model::predict;
 
     // updates the context tree with a new binary symbol
-    void update(symbol_t sym); // TODO: implement in predict.cpp
-    void update(const symbol_list_t &symlist); // TODO: implement in predict.cpp
-    void updateHistory(const symbol_list_t &symlist);
+    virtual void update(symbol_t sym);
+    virtual void updateHistory(symbol_t sym) { pushHistory(sym); }
 
     // removes the most recently observed symbol from the context tree
-    void revert(void); // TODO: implement in predict.cpp
-    //removes n most recently observed symbols from the context tree
-    void revert(size_t bits); 
+    virtual void revert(void);
 
     // shrinks the history down by n bits with changing the ct
-    void revertHistory(size_t bits);
+    virtual void revertHistory(size_t bits);
+
+    // the estimated probability of observing a particular symbol
+    virtual double predict(symbol_t sym);
 
-    // the estimated probability of observing a particular symbol or sequence
-    double predict(symbol_t sym); // TODO: implement in predict.cpp
-    double predict(symbol_list_t symlist); // TODO: implement in predict.cpp
+    // generate a single random symbol and update the context tree with it
+    using Model::genRandomSymbolAndUpdate;
+    virtual symbol_t genRandomSymbolAndUpdate(double &prob_zero);
 
-    // generate a specified number of random symbols
-    // distributed according to the context tree statistics
-    void genRandomSymbols(symbol_list_t &symbols, size_t bits);
+    // generate a random symbol for a rollout. With a rollout depth set, the
+    // symbol is sampled from the tree truncated at that depth and only added
+    // to the history.
+    virtual symbol_t genRolloutSymbol(void);
+    virtual void revertRollout(size_t bits);
 
-    // generate a specified number of random symbols distributed according to
-    // the context tree statistics and update the context tree with the newly
-    // generated bits
-    void genRandomSymbolsAndUpdate(symbol_list_t &symbols, size_t bits); // TODO: implement in predict.cpp
+    // sample rollouts from the tree truncated at depth k, 0 for full depth
+    void setRolloutDepth(size_t k) { m_rollout_depth = k; }
+    size_t rolloutDepth(void) const { return m_rollout_depth; }
 
     // the logarithm of the block probability of the whole sequence
 	double logBlockProbability(void);
@@ -106,22 +128,210 @@ public:
     size_t depth(void) const { return m_depth; }
 
     // the size of the stored history
-    size_t historySize(void) const { return m_history.size(); }
+    virtual size_t historySize(void) const { return m_history_base + m_history.size(); }
+
+    // a rolling hash of the last 'depth' history symbols
+    virtual uint64_t contextHash(void) const { return m_hash; }
 
     // number of nodes in the context tree
     size_t size(void) const { return m_root ? m_root->size() : 0; }
 
+    // change the maximum depth of the context tree, false if not supported
+    virtual bool setDepth(size_t depth);
+
     // io streaming of context tree, used to write/load
     friend std::ostream& operator<< (std::ostream &out, ContextTree &ct);
     friend std::istream& operator>> (std::istream &in, ContextTree &ct);
+    virtual void write(std::ostream &out) { out << (*this); }
+    virtual void read(std::istream &in) { in >> (*this); }
     
 
+protected:
+    // share the nodes of another tree, keeping only the part of its history
+    // needed as context
+    ContextTree(const ContextTree &other);
+
+    // make the node in slot exclusively owned by this tree, copying it if
+    // it is shared with a fork
+    static inline CTNode *own(CTNode *&slot);
+
+    // walk the context of the next symbol, storing the depth nodes visited
+    // in path, then update them bottom up with sym
+    inline void updatePath(CTNode **path, size_t depth, symbol_t sym);
+
+    // undo the effect of the most recent symbol on the nodes of its context,
+    // using path as scratch space for depth nodes
+    inline void revertPath(CTNode **path, size_t depth);
+
+    // add a symbol to, or remove the most recent symbol from, the history,
+    // rolling the context hash along with it
+    inline void pushHistory(symbol_t sym);
+    inline void popHistory(void);
+
+    // recompute the context hash from the history
+    void rehash(void);
+
 private:
+    // context trees are forked, never assigned
+    ContextTree &operator=(const ContextTree &other);
+
     history_t m_history; // the agents history
     CTNode *m_root;      // the root node of the context tree
     size_t m_depth;      // the maximum depth of the context tree
 
+    // number of history symbols dropped when this tree was forked
+    size_t m_history_base;
+
+    // depth at which rollouts truncate the tree, 0 for no truncation
+    size_t m_rollout_depth;
+
+    // scratch space for the context path of the runtime sized tree
+    std::vector<CTNode *> m_path;
+
+    // The context hash is the polynomial sum of hash_base^i * symbol over
+    // the last 'depth' symbols, the most recent having i = 0, with missing
+    // symbols counting as 0. Pushing a symbol multiplies it by the base and
+    // drops the oldest symbol's term, base^depth * symbol; popping undoes
+    // that using the base's multiplicative inverse.
+    static const uint64_t hash_base = 0x9E3779B97F4A7C15ULL;
+    static const uint64_t hash_base_inverse;
+    uint64_t m_hash;       // the context hash
+    uint64_t m_hash_out;   // hash_base^depth
 };
 
 
+// A context tree whose depth is known at compile time. The context path walked
+// by update and revert lives in a stack buffer of fixed size, which lets the
+// compiler unroll the per-node loops.
+template <size_t Depth>
+class FixedContextTree : public ContextTree {
+public:
+
+    FixedContextTree(void) : ContextTree(Depth) { }
+
+    virtual ContextTree *fork(void) const {
+        return new FixedContextTree<Depth>(*this);
+    }
+
+    using ContextTree::update;
+    using ContextTree::revert;
+
+    virtual void update(symbol_t sym) {
+        CTNode *path[Depth];
+        updatePath(path, Depth, sym);
+    }
+
+    virtual void revert(void) {
+        CTNode *path[Depth];
+        revertPath(path, Depth);
+    }
+
+    // the depth of a fixed context tree cannot change
+    virtual bool setDepth(size_t depth) { return depth == Depth; }
+};
+
+
+CTNode *ContextTree::own(CTNode *&slot) {
+    if (slot->shared()) {
+        CTNode *copy = new CTNode(*slot);
+        CTNode::release(slot);
+        slot = copy;
+    }
+    return slot;
+}
+
+
+void ContextTree::updatePath(CTNode **path, size_t depth, symbol_t sym) {
+
+    // Traverse tree to appropriate leaf.
+    path[0] = own(m_root);
+    history_t::iterator hist_it = m_history.end() - 1;
+    for (size_t n = 1; n < depth; ++n, --hist_it) {
+        CTNode *&slot = path[n-1]->m_child[*hist_it];
+        // Create children as they are needed.
+        if (slot == NULL) {
+            slot = new CTNode();
+        }
+        path[n] = own(slot);
+    }
+
+    // Leaf node: the weighted probability is the KT estimate
+    CTNode *leaf = path[depth - 1];
+    leaf->m_log_prob_est += leaf->logKTMul(sym);
+    ++(leaf->m_count[sym]);
+    leaf->m_log_prob_weighted = leaf->m_log_prob_est;
+
+    // Update probabilities from leaf back to root
+    for (size_t n = depth - 1; n-- > 0; ) {
+        // Local KT estimate update, in log form.
+        path[n]->m_log_prob_est += path[n]->logKTMul(sym);
+        // Update a / b.
+        ++(path[n]->m_count[sym]);
+        path[n]->updateLogProbWeighted();
+    }
+
+    pushHistory(sym);
+}
+
+
+void ContextTree::revertPath(CTNode **path, size_t depth) {
+
+    // Forks only keep enough history to revert their own updates
+    assert(m_history.size() >= depth);
+
+    // Get latest symbol (to update counts) and remove from history
+    symbol_t latest_sym = m_history.back();
+    popHistory();
+
+    // Traverse tree to leaf
+    path[0] = own(m_root);
+    history_t::iterator hist_it = m_history.end() - 1;
+    for (size_t n = 1; n < depth; ++n, --hist_it) {
+        path[n] = own(path[n-1]->m_child[*hist_it]);
+    }
+
+    // Update estimates
+    for (size_t n = depth; n-- > 0; ) {
+        CTNode *node = path[n];
+
+        // Remove effects of last update
+        --node->m_count[latest_sym];
+
+        // Delete node if it is no longer required
+        if (n > 0 && node->visits() == 0) {
+            CTNode *parent = path[n-1];
+            parent->m_child[parent->m_child[true] == node] = NULL;
+            CTNode::release(node);
+            continue;
+        }
+
+        node->m_log_prob_est -= node->logKTMul(latest_sym);
+
+        // Update weighted probabilities
+        if (n == depth - 1) {
+            // Leaf node
+            node->m_log_prob_weighted = node->m_log_prob_est;
+        } else {
+            node->updateLogProbWeighted();
+        }
+    }
+}
+
+
+void ContextTree::pushHistory(symbol_t sym) {
+    size_t size = m_history.size();
+    uint64_t out = size >= m_depth ? m_history[size - m_depth] : 0;
+    m_hash = m_hash * hash_base + sym - out * m_hash_out;
+    m_history.push_back(sym);
+}
+
+
+void ContextTree::popHistory(void) {
+    symbol_t sym = m_history.back();
+    m_history.pop_back();
+    size_t size = m_history.size();
+    uint64_t in = size >= m_depth ? m_history[size - m_depth] : 0;
+    m_hash = (m_hash - sym + in * m_hash_out) * hash_base_inverse;
+}
+
 #endif // __PREDICT_HPP__
@@ -1,38 +1,492 @@
 #include "search.hpp"
 
 #include "agent.hpp"
+#include "threadpool.hpp"
 #include "util.hpp"
 
+#include <algorithm>
+#include <cassert>
+#include <chrono>
 #include <cmath>
+#include <cstdlib>
+#include <new>
+#include <thread>
 
-SearchNode::SearchNode(bool is_chance_node,
-    unsigned int num_actions)
-    : m_chance_node(is_chance_node), m_visits(0) {
-    
-    //make list of unexplored actions
-    if (!is_chance_node) {
-        for (unsigned int i = 0; i < num_actions; ++i) {
-            m_unexplored_actions.push_back(i);
-        }
-    }
+// number of simulations a thread runs between checks of whether the
+// search may stop early
+static const visits_t confidence_interval = 32;
+
+// initial number of percept slots of a chance node
+static const unsigned int chance_capacity = 4;
+
+// key of an empty percept slot
+static const percept_t no_percept = ~0U;
+
+// log2 of the number of contexts whose rollout values are kept
+static const unsigned int value_bits = 16;
+
+
+SearchArena::SearchArena(size_t block_size) :
+	m_block_size(block_size),
+	m_block(0),
+	m_offset(0)
+{ }
+
+
+SearchArena::~SearchArena(void) {
+	for (size_t i = 0; i < m_blocks.size(); i++) {
+		delete [] m_blocks[i];
+	}
 }
 
-SearchNode::~SearchNode() {
-    // Destroy any allocated children.
-    for (std::map<unsigned int, SearchNode*>::iterator it = m_child.begin();
-    		it != m_child.end(); ++it) {
-        if (it->second != NULL) {
-            delete it->second;
-        }
-    }
+
+// allocate storage from the current block, moving on to the next block
+// (and allocating it the first time round) when it is full
+void *SearchArena::allocate(size_t bytes) {
+	const size_t align = sizeof(double) > sizeof(void *) ? sizeof(double) : sizeof(void *);
+	bytes = (bytes + align - 1) & ~(align - 1);
+
+	while (m_block < m_blocks.size() && m_offset + bytes > m_sizes[m_block]) {
+		m_block++;
+		m_offset = 0;
+	}
+	if (m_block == m_blocks.size()) {
+		size_t size = bytes > m_block_size ? bytes : m_block_size;
+		m_blocks.push_back(new char[size]);
+		m_sizes.push_back(size);
+	}
+
+	void *p = m_blocks[m_block] + m_offset;
+	m_offset += bytes;
+	return p;
+}
+
+
+TranspositionTable::TranspositionTable(unsigned int bits) :
+	m_size((size_t) 1 << bits),
+	m_shift(64 - (bits - 1)),
+	m_lookups(0),
+	m_hits(0),
+	m_replacements(0)
+{
+	assert(bits >= 2 && bits <= 32);
+	m_entries = new std::atomic<SearchNode *>[m_size];
+	clear();
+}
+
+
+TranspositionTable::~TranspositionTable(void) {
+	delete [] m_entries;
+}
+
+
+// empty every bucket. The nodes are left to their arenas.
+void TranspositionTable::clear(void) {
+	for (size_t i = 0; i < m_size; i++) {
+		m_entries[i].store(NULL, std::memory_order_relaxed);
+	}
+	m_lookups.store(0, std::memory_order_relaxed);
+	m_hits.store(0, std::memory_order_relaxed);
+	m_replacements.store(0, std::memory_order_relaxed);
+}
+
+
+// the node stored under a key, checking the key of each entry of its bucket
+SearchNode *TranspositionTable::find(uint64_t key) {
+	m_lookups.fetch_add(1, std::memory_order_relaxed);
+	std::atomic<SearchNode *> *entries = bucket(key);
+	for (unsigned int i = 0; i < 2; i++) {
+		SearchNode *node = entries[i].load(std::memory_order_acquire);
+		if (node != NULL && node->key() == key) {
+			m_hits.fetch_add(1, std::memory_order_relaxed);
+			return node;
+		}
+	}
+	return NULL;
+}
+
+
+// Store a node in an empty entry of its bucket, or else in place of the
+// less visited entry, whose node stays in the tree but can no longer be
+// found. Threads storing into the same bucket at once may overwrite each
+// other's nodes, which only costs a transposition.
+void TranspositionTable::insert(SearchNode *node) {
+	std::atomic<SearchNode *> *entries = bucket(node->key());
+	SearchNode *first = entries[0].load(std::memory_order_relaxed);
+	SearchNode *second = entries[1].load(std::memory_order_relaxed);
+	unsigned int i;
+	if (first == NULL) {
+		i = 0;
+	} else if (second == NULL) {
+		i = 1;
+	} else {
+		i = second->visits() < first->visits();
+		m_replacements.fetch_add(1, std::memory_order_relaxed);
+	}
+	entries[i].store(node, std::memory_order_release);
+}
+
+
+// a percept table segment of the given (power of two) capacity
+SearchNode::PerceptTable *SearchNode::createTable(SearchArena &arena,
+		unsigned int capacity) {
+	PerceptTable *table = arena.allocate<PerceptTable>(1);
+	table->capacity = capacity;
+	table->keys = arena.allocate< std::atomic<percept_t> >(capacity);
+	table->child = arena.allocate< std::atomic<SearchNode *> >(capacity);
+	for (unsigned int i = 0; i < capacity; i++) {
+		new (&table->keys[i]) std::atomic<percept_t>(no_percept);
+		new (&table->child[i]) std::atomic<SearchNode *>(NULL);
+	}
+	new (&table->next) std::atomic<PerceptTable *>(NULL);
+	return table;
+}
+
+
+SearchNode::SearchNode(bool is_chance_node, bool shared) :
+	m_chance_node(is_chance_node),
+	m_shared(shared),
+	m_mean(0.0),
+	m_visits(0),
+	m_virtual_loss(0),
+	m_log_visits(0.0),
+	m_observation(0),
+	m_reward(0),
+	m_key(0),
+	m_words(0),
+	m_child(NULL),
+	m_unexplored(NULL),
+	m_percepts(NULL),
+	m_children(0),
+	m_bits(NULL)
+{ }
+
+
+SearchNode *SearchNode::create(SearchArena &arena, bool is_chance_node,
+		unsigned int num_actions, bool shared) {
+	SearchNode *node = new (arena.allocate<SearchNode>(1))
+		SearchNode(is_chance_node, shared);
+
+	if (is_chance_node) {
+		// empty percept table
+		node->m_percepts = createTable(arena, chance_capacity);
+	}
+	else {
+		// every action is unexplored
+		node->m_words = (num_actions + 63) / 64;
+		node->m_child = arena.allocate< std::atomic<SearchNode *> >(num_actions);
+		node->m_unexplored = arena.allocate< std::atomic<uint64_t> >(node->m_words);
+		for (unsigned int a = 0; a < num_actions; a++) {
+			new (&node->m_child[a]) std::atomic<SearchNode *>(NULL);
+		}
+		for (unsigned int w = 0; w < node->m_words; w++) {
+			unsigned int bits = num_actions - 64 * w;
+			new (&node->m_unexplored[w]) std::atomic<uint64_t>(
+				bits >= 64 ? ~0ULL : (1ULL << bits) - 1);
+		}
+	}
+	return node;
+}
+
+
+// slot of a percept in a chance node table
+static inline unsigned int perceptSlot(percept_t percept, unsigned int capacity) {
+	return (unsigned int) ((percept * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+}
+
+
+// Find the slot of a percept in a chance node's table, claiming one if the
+// percept is new. A percept is kept in the first of its slots, in probe
+// order, that was empty when it was inserted. As slots are claimed
+// atomically and never emptied, threads inserting the same percept agree
+// on its slot. When a segment has no room within its probe limit, the
+// search continues in the next, twice as large, segment.
+std::atomic<SearchNode *> *SearchNode::claimPercept(SearchArena &arena,
+		percept_t percept, bool &claimed) {
+	assert(percept != no_percept);
+
+	PerceptTable *table = m_percepts;
+	for (;;) {
+		unsigned int mask = table->capacity - 1;
+		unsigned int limit = table->capacity / 2 + 1;
+		unsigned int i = perceptSlot(percept, table->capacity);
+		for (unsigned int probe = 0; probe < limit; probe++, i = (i + 1) & mask) {
+			percept_t key = table->keys[i].load(std::memory_order_acquire);
+			if (key == no_percept) {
+				if (table->keys[i].compare_exchange_strong(key, percept,
+						std::memory_order_acq_rel)) {
+					claimed = true;
+					return &table->child[i];
+				}
+				// key is now the percept of the thread that claimed the slot
+			}
+			if (key == percept) {
+				claimed = false;
+				return &table->child[i];
+			}
+		}
+
+		PerceptTable *next = table->next.load(std::memory_order_acquire);
+		if (next == NULL) {
+			// an unused segment is reclaimed with the arena
+			PerceptTable *grown = createTable(arena, 2 * table->capacity);
+			if (table->next.compare_exchange_strong(next, grown,
+					std::memory_order_acq_rel)) {
+				next = grown;
+			}
+		}
+		table = next;
+	}
+}
+
+
+// The transposition key of a decision node with the given model context and
+// number of cycles left. The context hash is mixed by the splitmix64
+// finalizer, so that the high bits used to pick a bucket depend on all of it.
+static inline uint64_t transpositionKey(uint64_t context, unsigned int dfr) {
+	uint64_t key = context + dfr * 0x9E3779B97F4A7C15ULL;
+	key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+	return key ^ (key >> 31);
+}
+
+
+// find or insert the decision node for a percept. A new percept of a tree
+// with a transposition table leads to the node already stored for the
+// agent's context, if any, and was reached by the same percept: revisits
+// update the model with the percept kept in the node, so a node is not
+// shared with paths that reach it by another. As the context includes the
+// number of cycles left, which decreases along every path, sharing nodes
+// cannot make cycles.
+SearchNode *SearchNode::perceptChild(Agent &agent, SearchContext &context,
+		percept_t percept, percept_t observation, percept_t reward,
+		unsigned int dfr) {
+	bool claimed;
+	std::atomic<SearchNode *> *slot = claimPercept(context.arena, percept, claimed);
+	if (claimed) {
+		TranspositionTable *table = context.transpositions;
+		SearchNode *child = NULL;
+		uint64_t key = 0;
+		bool stored = false;
+		if (table != NULL) {
+			key = transpositionKey(agent.contextHash(), dfr);
+			child = table->find(key);
+			stored = child != NULL;
+			if (stored && (child->m_observation != observation
+					|| child->m_reward != reward)) {
+				child = NULL;
+			}
+		}
+		if (child == NULL) {
+			child = create(context.arena, false, agent.numActions(), m_shared);
+			child->m_observation = observation;
+			child->m_reward = reward;
+			child->m_key = key;
+			if (table != NULL && !stored) table->insert(child);
+			context.searcher->addNode();
+		}
+		slot->store(child, std::memory_order_release);
+		m_children.fetch_add(1, std::memory_order_relaxed);
+		return child;
+	}
+
+	// wait for the thread inserting it to publish the node
+	SearchNode *child;
+	while ((child = slot->load(std::memory_order_acquire)) == NULL) {
+		std::this_thread::yield();
+	}
+	return child;
+}
+
+
+// Walks a chance node's tree of percept prefixes along the bits of a
+// percept, adding the prefixes that are new. A node is published once its
+// probability is set; of two threads adding the same prefix at once, the
+// node of the first is kept and the other's is left in its arena.
+class SearchNode::BitCursor : public PerceptCache {
+
+public:
+
+	BitCursor(SearchArena &arena, std::atomic<PerceptBit *> *root) :
+		m_arena(arena), m_slot(root) { }
+
+	virtual double probZero(void) {
+		PerceptBit *bit = m_slot->load(std::memory_order_acquire);
+		return bit != NULL ? bit->prob_zero : -1.0;
+	}
+
+	virtual void next(symbol_t sym, double prob_zero) {
+		PerceptBit *bit = m_slot->load(std::memory_order_acquire);
+		if (bit == NULL) {
+			PerceptBit *created = m_arena.allocate<PerceptBit>(1);
+			created->prob_zero = prob_zero;
+			new (&created->child[0]) std::atomic<PerceptBit *>(NULL);
+			new (&created->child[1]) std::atomic<PerceptBit *>(NULL);
+			bit = m_slot->compare_exchange_strong(bit, created,
+				std::memory_order_acq_rel) ? created : bit;
+		}
+		m_slot = &bit->child[sym];
+	}
+
+private:
+
+	SearchArena &m_arena;
+	std::atomic<PerceptBit *> *m_slot; // where the current prefix is kept
+};
+
+
+// choose a child of this chance node in proportion to its visits
+SearchNode *SearchNode::revisitChild(void) const {
+	visits_t total = 0;
+	for (PerceptTable *table = m_percepts; table != NULL;
+			table = table->next.load(std::memory_order_acquire)) {
+		for (unsigned int i = 0; i < table->capacity; i++) {
+			SearchNode *child = table->child[i].load(std::memory_order_acquire);
+			if (child != NULL) total += child->visits();
+		}
+	}
+
+	SearchNode *chosen = NULL;
+	double r = rand01() * total;
+	for (PerceptTable *table = m_percepts; table != NULL;
+			table = table->next.load(std::memory_order_acquire)) {
+		for (unsigned int i = 0; i < table->capacity; i++) {
+			SearchNode *child = table->child[i].load(std::memory_order_acquire);
+			if (child == NULL) continue;
+			chosen = child;
+			r -= child->visits();
+			if (r < 0.0) return chosen;
+		}
+	}
+	return chosen;
+}
+
+
+// the decision node for a percept, or NULL if it has not been seen
+SearchNode *SearchNode::findPercept(percept_t percept) const {
+	for (PerceptTable *table = m_percepts; table != NULL;
+			table = table->next.load(std::memory_order_acquire)) {
+		unsigned int mask = table->capacity - 1;
+		unsigned int limit = table->capacity / 2 + 1;
+		unsigned int i = perceptSlot(percept, table->capacity);
+		for (unsigned int probe = 0; probe < limit; probe++, i = (i + 1) & mask) {
+			percept_t key = table->keys[i].load(std::memory_order_acquire);
+			if (key == no_percept) return NULL;
+			if (key == percept) return table->child[i].load(std::memory_order_acquire);
+		}
+	}
+	return NULL;
+}
+
+
+// count the nodes of the subtree below this node
+visits_t SearchNode::size(unsigned int num_actions) const {
+	visits_t n = 1;
+	if (m_chance_node) {
+		for (PerceptTable *table = m_percepts; table != NULL;
+				table = table->next.load(std::memory_order_acquire)) {
+			for (unsigned int i = 0; i < table->capacity; i++) {
+				SearchNode *child = table->child[i].load(std::memory_order_acquire);
+				if (child != NULL) n += child->size(num_actions);
+			}
+		}
+	}
+	else {
+		for (unsigned int a = 0; a < num_actions; a++) {
+			SearchNode *child = m_child[a].load(std::memory_order_acquire);
+			if (child != NULL) n += child->size(num_actions);
+		}
+	}
+	return n;
+}
+
+
+// true if any action of this decision node is unexplored
+bool SearchNode::hasUnexplored(void) const {
+	for (unsigned int w = 0; w < m_words; w++) {
+		if (m_unexplored[w].load(std::memory_order_relaxed) != 0) return true;
+	}
+	return false;
+}
+
+
+// copy the subtree below this node into an arena
+SearchNode *SearchNode::copy(SearchArena &arena, unsigned int num_actions,
+		bool shared, std::map<const SearchNode *, SearchNode *> *copies) const {
+	if (copies != NULL) {
+		std::map<const SearchNode *, SearchNode *>::iterator it = copies->find(this);
+		if (it != copies->end()) return it->second;
+	}
+
+	SearchNode *node = create(arena, m_chance_node, num_actions, shared);
+	if (copies != NULL) (*copies)[this] = node;
+	node->m_mean.store(expectation(), std::memory_order_relaxed);
+	node->m_visits.store(visits(), std::memory_order_relaxed);
+	node->m_log_visits.store(m_log_visits.load(std::memory_order_relaxed),
+		std::memory_order_relaxed);
+	node->m_observation = m_observation;
+	node->m_reward = m_reward;
+	node->m_key = m_key;
+	node->m_children.store(m_children.load(std::memory_order_relaxed),
+		std::memory_order_relaxed);
+
+	if (m_chance_node) {
+		for (PerceptTable *table = m_percepts; table != NULL;
+				table = table->next.load(std::memory_order_acquire)) {
+			for (unsigned int i = 0; i < table->capacity; i++) {
+				SearchNode *child = table->child[i].load(std::memory_order_acquire);
+				if (child == NULL) continue;
+				bool claimed;
+				percept_t percept = table->keys[i].load(std::memory_order_relaxed);
+				node->claimPercept(arena, percept, claimed)->store(
+					child->copy(arena, num_actions, shared, copies),
+					std::memory_order_relaxed);
+			}
+		}
+	}
+	else {
+		for (unsigned int w = 0; w < m_words; w++) {
+			node->m_unexplored[w].store(m_unexplored[w].load(std::memory_order_relaxed),
+				std::memory_order_relaxed);
+		}
+		for (unsigned int a = 0; a < num_actions; a++) {
+			SearchNode *child = m_child[a].load(std::memory_order_acquire);
+			if (child == NULL) continue;
+			node->m_child[a].store(child->copy(arena, num_actions, shared, copies),
+				std::memory_order_relaxed);
+		}
+	}
+	return node;
 }
 
 // simulate a sequence of random actions, returning the accumulated reward.
-static reward_t playout(Agent &agent, unsigned int playout_len) {
+// Percepts are drawn from the agent's rollout model, which is restored
+// before returning. A playout truncated at 'rollout-length' cycles values
+// the rest of the horizon by the mean reward per cycle seen after the
+// context it ends in, which each step of a truncated playout contributes
+// to. A context not seen yet is valued by the mean reward of the playout.
+reward_t Searcher::playout(Agent &agent, unsigned int playout_len,
+		std::vector<value_sample_t> *learned) const {
+	ModelUndo undo(agent);
+	agent.beginRollout();
+
+	unsigned int length = playout_len;
+	if (m_rollout_length > 0 && m_rollout_length < playout_len) {
+		length = m_rollout_length;
+	}
+
+	// the uniform numbers the random actions are picked with, drawn a
+	// batch at a time
+	const unsigned int batch = 16;
+	double uniforms[batch];
+
 	reward_t r = 0;
-	for (unsigned int i = 0; i < playout_len; ++i) {
+	for (unsigned int i = 0; i < length; ++i) {
+		uint64_t context = m_values != NULL ? agent.rolloutModel()->contextHash() : 0;
+
 	    // Pick a random action
-	    action_t a = agent.genRandomAction();
+		if (i % batch == 0) rand01(uniforms, std::min(batch, length - i));
+	    action_t a = (action_t) (uniforms[i % batch] * agent.numActions());
 	    agent.modelUpdate(a);
 		
 		// Generate a random percept distributed according to the agent's
@@ -42,100 +496,955 @@ static reward_t playout(Agent &agent, unsigned int playout_len) {
 	    agent.genPerceptAndUpdate(obs, rew);
 	    
 	    r = r + rew;
+		if (m_values == NULL) continue;
+		if (learned != NULL) {
+			learned->push_back(value_sample_t(context, rew));
+		} else {
+			learnValue(context, rew);
+		}
     }
+
+	if (length < playout_len) {
+		double mean = r / length;
+		contextValue(agent.rolloutModel()->contextHash(), mean);
+		r += (playout_len - length) * mean;
+	}
+
+	agent.endRollout(undo);
 	return r;
 }
 
+
+// the entry of a context in the table of rollout values
+static inline uint64_t valueSlot(uint64_t context, unsigned int shift) {
+	return (context * 0x9E3779B97F4A7C15ULL) >> shift;
+}
+
+
+// Add a reward seen after a context to its running mean. An entry holding
+// another context is taken over. Threads updating an entry at once may
+// lose an update, which only makes the mean a little less accurate.
+void Searcher::learnValue(uint64_t context, reward_t reward) const {
+	ValueEntry &entry = m_values[valueSlot(context, m_value_shift)];
+	visits_t count = entry.count.load(std::memory_order_relaxed);
+	double mean = entry.mean.load(std::memory_order_relaxed);
+	if (count == 0 || entry.key.load(std::memory_order_relaxed) != context) {
+		entry.key.store(context, std::memory_order_relaxed);
+		count = 0;
+		mean = 0.0;
+	}
+	entry.mean.store(mean + (reward - mean) / (count + 1), std::memory_order_relaxed);
+	entry.count.store(count + 1, std::memory_order_relaxed);
+}
+
+
+// the mean reward per cycle seen after a context, if it has been seen
+void Searcher::contextValue(uint64_t context, double &mean) const {
+	ValueEntry &entry = m_values[valueSlot(context, m_value_shift)];
+	if (entry.count.load(std::memory_order_relaxed) > 0
+			&& entry.key.load(std::memory_order_relaxed) == context) {
+		mean = entry.mean.load(std::memory_order_relaxed);
+	}
+}
+
 // UCB action selection strategy
-action_t SearchNode::selectAction(Agent& agent, unsigned int dfr) {
-    //choose unexplored action at random if any and append to tree
-    if (!m_unexplored_actions.empty()) {
-        int action_index = randRange(m_unexplored_actions.size());
-        action_t action = m_unexplored_actions.at(action_index);
-        m_unexplored_actions.erase(m_unexplored_actions.begin() + action_index);
-
-        m_child[action] = new SearchNode(true, agent.numActions());
+action_t SearchNode::selectAction(Agent& agent, SearchContext &context,
+		unsigned int dfr) {
+    //choose unexplored action at random if any and append to tree.
+    //Another thread may take the chosen action first, then choose again.
+    for (;;) {
+        unsigned int unexplored = 0;
+        for (unsigned int w = 0; w < m_words; w++) {
+            unexplored += __builtin_popcountll(m_unexplored[w].load(std::memory_order_relaxed));
+        }
+        if (unexplored == 0) break;
+
+        // find the (action_index)th unexplored action, in increasing order
+        unsigned int action_index = randRange(unexplored);
+        unsigned int w = 0;
+        uint64_t word = 0;
+        for (; w < m_words; w++) {
+            word = m_unexplored[w].load(std::memory_order_relaxed);
+            unsigned int n = __builtin_popcountll(word);
+            if (action_index < n) break;
+            action_index -= n;
+        }
+        if (w == m_words) continue;
+
+        uint64_t bits = word;
+        for (; action_index > 0; action_index--) bits &= bits - 1;
+        action_t action = 64 * w + __builtin_ctzll(bits);
+        uint64_t explored = word & ~(1ULL << (action % 64));
+        if (!m_shared) {
+            m_unexplored[w].store(explored, std::memory_order_relaxed);
+        } else if (!m_unexplored[w].compare_exchange_strong(word, explored,
+                std::memory_order_relaxed)) {
+            continue;
+        }
+
+        m_child[action].store(create(context.arena, true, agent.numActions(), m_shared),
+            std::memory_order_release);
+        context.searcher->addNode();
         return action;
-    } else {
-        action_t arg_max = 0;
-        double C = sqrt(2);
-
-        double max = (1.0 / (dfr * agent.maxReward())) * m_child[0]->m_mean
-                    + C * sqrt((log(m_visits)/m_child[0]->m_visits));
-        //search for argmax
-        for (action_t a = 1; a < agent.numActions(); ++a) {
-            double f = (1.0 / (dfr * agent.maxReward())) * m_child[a]->m_mean
-                    + C * sqrt((log(m_visits)/m_child[a]->m_visits));
-            // Notes: agent.minReward() defined as 0, so omitted.
-            if (f > max) {
-                max = f;
-                arg_max = a;
-            }
+    }
+
+    action_t arg_max = 0;
+    double C = sqrt(2);
+    double scale = 1.0 / (dfr * agent.maxReward());
+    double log_visits = m_log_visits.load(std::memory_order_relaxed);
+
+    double max = 0.0;
+    //search for argmax
+    for (action_t a = 0; a < agent.numActions(); ++a) {
+        // the action may just have been taken by another thread
+        SearchNode *child;
+        while ((child = m_child[a].load(std::memory_order_acquire)) == NULL) {
+            std::this_thread::yield();
+        }
+
+        // count every thread still sampling below the child as a loss,
+        // so that concurrent threads spread out over the tree
+        double mean = child->m_mean.load(std::memory_order_relaxed);
+        double visits = child->m_visits.load(std::memory_order_relaxed);
+        unsigned int loss = child->m_virtual_loss.load(std::memory_order_relaxed);
+        if (loss > 0) {
+            mean = mean * visits / (visits + loss);
+            visits += loss;
+        }
+
+        double f = scale * mean + C * sqrt((log_visits/visits));
+        // Notes: agent.minReward() defined as 0, so omitted.
+        if (a == 0 || f > max) {
+            max = f;
+            arg_max = a;
         }
-        
-        return arg_max;
     }
+
+    return arg_max;
 }
 
 // Sample one possible sequence of future events, up to 'dfr' cycles.
-reward_t SearchNode::sample(Agent &agent, unsigned int dfr) {
+reward_t SearchNode::sample(Agent &agent, SearchContext &context,
+		unsigned int dfr) {
+    SearchArena &arena = context.arena;
     double newReward;
     if (dfr == 0) {
         return 0;
     } else if (m_chance_node) {
-        // Generate whole observation-reward percept,
-        // according to the agent's model of the environment.
         percept_t obs;
         percept_t rew;
-        agent.genPerceptAndUpdate(obs, rew);
+        SearchNode *child;
+        if (context.searcher->widen(m_visits.load(std::memory_order_relaxed),
+                m_children.load(std::memory_order_relaxed))) {
+            // Generate whole observation-reward percept,
+            // according to the agent's model of the environment.
+            if (context.searcher->cachesPercepts()) {
+                BitCursor cursor(arena, &m_bits);
+                agent.genPerceptAndUpdate(obs, rew, cursor);
+            } else {
+                agent.genPerceptAndUpdate(obs, rew);
+            }
+            context.path.push_back(obs);
+            context.path.push_back(rew);
 
-        // Calculate the index of whole percept
-        percept_t percept = (rew << agent.numObsBits()) | obs;
-        
-        if (m_child.count(percept) == 0) {
-            m_child[percept] = new SearchNode(false, agent.numActions());
+            // Calculate the index of whole percept
+            percept_t percept = context.searcher->perceptKey(agent, obs, rew);
+            if (context.searcher->mayExpand()) {
+                child = perceptChild(agent, context, percept, obs, rew, dfr - 1);
+            } else {
+                // without room for a new node, an unseen percept is
+                // played out from here
+                child = findPercept(percept);
+            }
+        } else {
+            // revisit one of the percepts seen so far
+            child = revisitChild();
+            obs = child->m_observation;
+            rew = child->m_reward;
+            agent.modelUpdate(obs, rew);
+            context.path.push_back(obs);
+            context.path.push_back(rew);
+        }
+        if (child != NULL) {
+            newReward = rew + child->sample(agent, context, dfr - 1);
+        } else {
+            newReward = rew + context.searcher->leafValue(agent, context, dfr - 1);
         }
-        newReward = rew + m_child[percept]->sample(agent, dfr - 1);
-    } else if (m_visits == 0) {
-        newReward = playout(agent, dfr);
+        context.path.resize(context.path.size() - 2);
+    } else if (m_visits.load(std::memory_order_relaxed) == 0
+            || (!context.searcher->mayExpand() && hasUnexplored())) {
+        newReward = context.searcher->leafValue(agent, context, dfr);
     } else {
     	// Select an action to sample.
-        action_t action = selectAction(agent, dfr);
+        action_t action = selectAction(agent, context, dfr);
         agent.modelUpdate(action);
-        newReward = m_child[action]->sample(agent, dfr);
+        context.path.push_back(action);
+        SearchNode *child = m_child[action].load(std::memory_order_acquire);
+        if (m_shared) child->m_virtual_loss.fetch_add(1, std::memory_order_relaxed);
+        newReward = child->sample(agent, context, dfr);
+        if (m_shared) child->m_virtual_loss.fetch_sub(1, std::memory_order_relaxed);
+        context.path.pop_back();
+    }
+    // Update our estimate of the future reward. Concurrent updates of a
+    // shared node may interleave, giving a close approximation of the mean.
+    visits_t visits;
+    double mean = m_mean.load(std::memory_order_relaxed);
+    if (!m_shared) {
+        visits = m_visits.load(std::memory_order_relaxed);
+        m_visits.store(visits + 1, std::memory_order_relaxed);
+        m_mean.store((1.0 / (double) (visits + 1)) * (newReward + visits * mean),
+            std::memory_order_relaxed);
+    } else {
+        visits = m_visits.fetch_add(1, std::memory_order_relaxed);
+        while (!m_mean.compare_exchange_weak(mean,
+                (1.0 / (double) (visits + 1)) * (newReward + visits * mean),
+                std::memory_order_relaxed));
+    }
+    if (!m_chance_node) {
+        m_log_visits.store(log(visits + 1), std::memory_order_relaxed);
     }
-    // Update our estimate of the future reward.
-    m_mean = (1.0 / (double) (m_visits + 1)) * (newReward + m_visits * m_mean);
-    ++m_visits;
     return newReward;
 }
 
-// determine the best action by searching ahead using MCTS
-extern action_t search(Agent &agent, timelimit_t timelimit) {
+// Percept abstractions, giving the key a chance node branches on for a
+// percept. The agent's model always sees the full percept.
+
+// the whole percept
+static percept_t fullPercept(percept_t observation, percept_t reward,
+		unsigned int obs_bits, percept_t mask) {
+	return (reward << obs_bits) | observation;
+}
+
+// the reward alone
+static percept_t rewardOnly(percept_t observation, percept_t reward,
+		unsigned int obs_bits, percept_t mask) {
+	return reward;
+}
+
+// the reward and the observation bits selected by the mask
+static percept_t maskedPercept(percept_t observation, percept_t reward,
+		unsigned int obs_bits, percept_t mask) {
+	return (reward << obs_bits) | (observation & mask);
+}
+
+
+// set up a search as configured by the agent's options
+Searcher::Searcher(options_t &options) :
+	m_threads(1),
+	m_parallelism(RootParallel),
+	m_rollouts(1),
+	m_pool(NULL),
+	m_reuse(true),
+	m_searched(false),
+	m_side(0),
+	m_deadline_ms(0),
+	m_simulations(0),
+	m_widening_c(0.0),
+	m_widening_alpha(0.5),
+	m_abstraction(fullPercept),
+	m_observation_mask(0),
+	m_transposition_lookups(0),
+	m_transposition_hits(0),
+	m_ponder(0),
+	m_ponder_pool(NULL),
+	m_pondering(false),
+	m_stop(false),
+	m_pondered(0),
+	m_early_stop(false),
+	m_early_stop_delta(0.01),
+	m_confident(false),
+	m_saved(0),
+	m_value_gap(0.0),
+	m_lazy_revert(false),
+	m_percept_cache(false),
+	m_rollout_length(0),
+	m_values(NULL),
+	m_value_shift(64),
+	m_max_nodes(0),
+	m_nodes(0),
+	m_kept_nodes(0),
+	m_deterministic(false),
+	m_seed(0)
+{
+	if (options.count("search-threads") > 0) {
+		strExtract(options["search-threads"], m_threads);
+	}
+	if (m_threads == 0) m_threads = std::thread::hardware_concurrency();
+	if (m_threads == 0) m_threads = 1;
+
+	if (options.count("search-parallelism") > 0) {
+		const std::string &parallelism = options["search-parallelism"];
+		if (parallelism == "tree") {
+			m_parallelism = TreeParallel;
+		}
+		else if (parallelism == "leaf") {
+			m_parallelism = LeafParallel;
+		}
+		else if (parallelism != "root") {
+			std::cerr << "WARNING: unknown search-parallelism '" << parallelism
+				<< "', using root parallel search" << std::endl;
+		}
+	}
+
+	if (options.count("rollouts-per-leaf") > 0) {
+		strExtract(options["rollouts-per-leaf"], m_rollouts);
+	}
+	if (m_rollouts == 0) m_rollouts = 1;
+
+	if (options.count("widening-c") > 0) {
+		strExtract(options["widening-c"], m_widening_c);
+	}
+	if (options.count("widening-alpha") > 0) {
+		strExtract(options["widening-alpha"], m_widening_alpha);
+	}
+
+	if (options.count("percept-abstraction") > 0) {
+		const std::string &abstraction = options["percept-abstraction"];
+		if (abstraction == "reward") {
+			m_abstraction = rewardOnly;
+		}
+		else if (abstraction == "mask") {
+			m_abstraction = maskedPercept;
+			if (options.count("observation-mask") > 0) {
+				m_observation_mask = strtoul(options["observation-mask"].c_str(), NULL, 0);
+			}
+		}
+		else if (abstraction != "full") {
+			std::cerr << "WARNING: unknown percept-abstraction '" << abstraction
+				<< "', branching on the full percept" << std::endl;
+		}
+	}
+
+	if (options.count("search-deadline-ms") > 0) {
+		strExtract(options["search-deadline-ms"], m_deadline_ms);
+	}
+
+	if (options.count("lazy-revert") > 0) {
+		m_lazy_revert = options["lazy-revert"] != "0";
+	}
+
+	if (options.count("percept-cache") > 0) {
+		m_percept_cache = options["percept-cache"] != "0";
+	}
+	if (options.count("search-max-nodes") > 0) {
+		strExtract(options["search-max-nodes"], m_max_nodes);
+	}
+
+	if (options.count("rollout-length") > 0) {
+		strExtract(options["rollout-length"], m_rollout_length);
+	}
+	if (m_rollout_length > 0) {
+		m_values = new ValueEntry[(size_t) 1 << value_bits];
+		m_value_shift = 64 - value_bits;
+		for (size_t i = 0; i < (size_t) 1 << value_bits; i++) {
+			m_values[i].key.store(0, std::memory_order_relaxed);
+			m_values[i].mean.store(0.0, std::memory_order_relaxed);
+			m_values[i].count.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	if (options.count("search-reuse") > 0) {
+		m_reuse = options["search-reuse"] != "0";
+	}
+
+	if (options.count("ponder") > 0) {
+		strExtract(options["ponder"], m_ponder);
+	}
+	// A deterministic search runs leaf parallel, as only the calling
+	// thread then grows the tree (see checkOptions()), and neither ponders
+	// nor has a deadline, which depend on timing.
+	if (options.count("search-deterministic") > 0) {
+		m_deterministic = options["search-deterministic"] != "0";
+	}
+	if (m_deterministic) {
+		assert(m_threads == 1 || m_parallelism == LeafParallel);
+		m_parallelism = LeafParallel;
+		if (m_deadline_ms > 0 || m_ponder > 0) {
+			std::cerr << "WARNING: a deterministic search neither ponders "
+				<< "nor has a deadline" << std::endl;
+		}
+		m_deadline_ms = 0;
+		m_ponder = 0;
+		m_seed = rand64();
+	}
+	// the helper threads of a leaf parallel search only share out the
+	// playouts of a leaf
+	if (m_parallelism == LeafParallel && m_threads > 1 && m_rollouts == 1) {
+		std::cerr << "WARNING: a leaf parallel search with one rollout per "
+			<< "leaf runs on a single thread" << std::endl;
+	}
+
+	if (m_ponder > 0) {
+		// the speculative searches are single threaded and not pondering
+		options_t ponder_options = options;
+		ponder_options["ponder"] = "0";
+		ponder_options["search-threads"] = "1";
+		ponder_options["search-parallelism"] = "root";
+		ponder_options["search-reuse"] = "0";
+		m_ponder_pool = new ThreadPool(m_ponder);
+		for (unsigned int i = 0; i < m_ponder; i++) {
+			m_ponderers.push_back(new Searcher(ponder_options));
+		}
+	}
+
+	// the calling thread is the first search thread
+	if (m_threads > 1) m_pool = new ThreadPool(m_threads - 1);
+	for (unsigned int i = 0; i < m_threads; i++) {
+		m_contexts.push_back(new SearchContext());
+		m_contexts[i]->searcher = this;
+	}
+
+	unsigned int num_trees = m_parallelism == RootParallel ? m_threads : 1;
+	unsigned int transposition_bits = 0;
+	if (options.count("transposition-bits") > 0) {
+		strExtract(options["transposition-bits"], transposition_bits);
+	}
+	if (transposition_bits > 32) {
+		std::cerr << "WARNING: transposition-bits is at most 32" << std::endl;
+		transposition_bits = 32;
+	}
+	if (transposition_bits == 1) {
+		std::cerr << "WARNING: transposition-bits is at least 2" << std::endl;
+		transposition_bits = 2;
+	}
+	for (unsigned int i = 0; i < num_trees && transposition_bits > 0; i++) {
+		m_transpositions.push_back(new TranspositionTable(transposition_bits));
+	}
+
+	// Under an abstraction, or with nodes shared through a transposition
+	// table, a chance node is reached by paths whose model states differ,
+	// so the probabilities of its bits can't be kept.
+	if (m_percept_cache && m_abstraction != fullPercept) {
+		std::cerr << "WARNING: percept-cache needs percept-abstraction=full, disabling it" << std::endl;
+		m_percept_cache = false;
+	}
+	if (m_percept_cache && hasTranspositions()) {
+		std::cerr << "WARNING: percept-cache does not work with transposition-bits, disabling it" << std::endl;
+		m_percept_cache = false;
+	}
+
+	if (options.count("early-stop") > 0) {
+		m_early_stop = options["early-stop"] != "0";
+	}
+	if (options.count("early-stop-delta") > 0) {
+		strExtract(options["early-stop-delta"], m_early_stop_delta);
+	}
+	if (m_early_stop_delta <= 0.0 || m_early_stop_delta >= 1.0) {
+		std::cerr << "WARNING: early-stop-delta must lie in (0, 1), using 0.01" << std::endl;
+		m_early_stop_delta = 0.01;
+	}
+
+	m_roots.resize(num_trees, NULL);
+	m_limits.resize(num_trees, 0);
+	std::vector< std::atomic<timelimit_t> >(num_trees).swap(m_counts);
+	for (unsigned int i = 0; i < num_trees && (m_reuse || m_ponder > 0); i++) {
+		m_keep[0].push_back(new SearchArena());
+		m_keep[1].push_back(new SearchArena());
+	}
+}
+
+
+// Threads growing trees at once make a search depend on their timing, so a
+// deterministic search with several threads must be leaf parallel
+bool Searcher::checkOptions(options_t &options) {
+	unsigned int threads = 1;
+	if (options.count("search-threads") > 0) {
+		strExtract(options["search-threads"], threads);
+	}
+	if (threads > 1 && options.count("search-deterministic") > 0
+			&& options["search-deterministic"] != "0"
+			&& options.count("search-parallelism") > 0
+			&& options["search-parallelism"] != "leaf") {
+		std::cerr << "ERROR: a deterministic search with several threads "
+			<< "needs search-parallelism=leaf" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+
+Searcher::~Searcher(void) {
+	stopPondering();
+	delete m_ponder_pool;
+	for (size_t i = 0; i < m_ponderers.size(); i++) {
+		delete m_ponderers[i];
+	}
+	delete m_pool;
+	for (size_t i = 0; i < m_contexts.size(); i++) {
+		delete m_contexts[i];
+	}
+	for (size_t i = 0; i < m_keep[0].size(); i++) {
+		delete m_keep[0][i];
+		delete m_keep[1][i];
+	}
+	for (size_t i = 0; i < m_transpositions.size(); i++) {
+		delete m_transpositions[i];
+	}
+	delete [] m_values;
+}
+
+
+// the key of a percept in the children of a chance node
+percept_t Searcher::perceptKey(const Agent &agent, percept_t observation,
+		percept_t reward) const {
+	return m_abstraction(observation, reward, agent.numObsBits(),
+		m_observation_mask);
+}
+
+
+// Progressive widening: a chance node only samples a new percept while
+// it has fewer than c * visits^alpha children
+bool Searcher::widen(visits_t visits, unsigned int children) const {
+	return m_widening_c <= 0.0 || children == 0
+		|| children < m_widening_c * pow((double) visits, m_widening_alpha);
+}
+
+
+// Search the most probable percepts to follow the agent's last action, each
+// from its own fork of the agent updated with the percept. The searches run
+// until they reach the time limit or are stopped by advance().
+void Searcher::ponder(const Agent &agent, timelimit_t timelimit) {
+	if (m_ponder == 0) return;
+	stopPondering();
+
+	Agent *probe = agent.fork();
+	probe->probablePercepts(m_ponder, m_ponder_observations, m_ponder_rewards);
+	delete probe;
+
+	for (size_t i = 0; i < m_ponder_observations.size(); i++) {
+		Agent *fork = agent.fork();
+		fork->modelUpdate(m_ponder_observations[i], m_ponder_rewards[i]);
+		m_ponder_agents.push_back(fork);
+
+		Searcher *ponderer = m_ponderers[i];
+		ponderer->m_stop.store(false);
+		rng_state_t seed = splitRandom();
+		m_ponder_pool->submit([ponderer, fork, timelimit, seed]() {
+			rng_state_t saved = rngState();
+			rngState() = seed;
+			ponderer->search(*fork, timelimit);
+			rngState() = saved;
+		});
+	}
+	m_pondering = true;
+}
+
+
+// end the speculative searches, keeping their trees
+void Searcher::stopPondering(void) {
+	if (!m_pondering) return;
+	for (size_t i = 0; i < m_ponderers.size(); i++) {
+		m_ponderers[i]->m_stop.store(true);
+	}
+	m_ponder_pool->wait();
+	for (size_t i = 0; i < m_ponder_agents.size(); i++) {
+		delete m_ponder_agents[i];
+	}
+	m_ponder_agents.clear();
+	m_pondering = false;
+}
+
+
+// Keep the subtrees reached by the action and percept for the next search.
+// The tree pondered for the percept, if any, replaces the first of them.
+void Searcher::advance(const Agent &agent, action_t action,
+		percept_t observation, percept_t reward) {
+	SearchNode *pondered = NULL;
+	m_pondered = 0;
+	if (m_pondering) {
+		stopPondering();
+		for (size_t i = 0; i < m_ponder_observations.size(); i++) {
+			if (m_ponder_observations[i] == observation
+					&& m_ponder_rewards[i] == reward) {
+				pondered = m_ponderers[i]->m_trees[0];
+				m_pondered = m_ponderers[i]->m_simulations;
+			}
+		}
+	}
+	if (!m_reuse && pondered == NULL && m_roots[0] == NULL) return;
+
+	// the subtrees are copied out of the arenas holding the current roots
+	// and the last search's nodes, so both may then be reset
+	unsigned int side = 1 - m_side;
+	percept_t percept = perceptKey(agent, observation, reward);
+	m_kept_nodes = 0;
+	for (size_t i = 0; i < m_roots.size(); i++) {
+		m_keep[side][i]->reset();
+		m_roots[i] = NULL;
+
+		SearchNode *next = NULL;
+		if (i == 0 && pondered != NULL) {
+			next = pondered;
+		} else if (m_reuse && m_searched) {
+			SearchNode *chance = m_trees[i]->child(action);
+			next = chance ? chance->findPercept(percept) : NULL;
+		}
+		if (next != NULL) {
+			// subtrees with transpositions are DAGs, whose shared nodes are
+			// copied once
+			std::map<const SearchNode *, SearchNode *> copies;
+			m_roots[i] = next->copy(*m_keep[side][i], agent.numActions(),
+				m_parallelism == TreeParallel && m_threads > 1,
+				hasTranspositions() ? &copies : NULL);
+			if (limitsNodes()) m_kept_nodes += m_roots[i]->size(agent.numActions());
+		}
+	}
+	m_side = side;
+	m_searched = false;
+}
+
+
+// Value a new leaf by the mean reward of its playouts. In a deterministic
+// search the r'th playout draws from a stream keyed by the simulation's
+// stream and r, whichever thread runs it, and the values are summed in the order
+// of the playouts. Their rollout values are then learned in the same
+// order once every playout has ended.
+reward_t Searcher::leafValue(Agent &agent, SearchContext &context,
+        unsigned int dfr) {
+    if (m_rollouts == 1) return playout(agent, dfr);
+
+    std::vector<reward_t> values(m_rollouts, 0.0);
+    std::vector< std::vector<value_sample_t> > learned;
+    if (m_deterministic && m_values != NULL) learned.resize(m_rollouts);
+    uint64_t stream = context.stream;
+
+    if (m_parallelism == LeafParallel && m_threads > 1) {
+        // every helper thread takes its agent from the root to the leaf,
+        // plays out its share from there with its own random stream, and
+        // takes it back to the root
+        const std::vector<percept_t> *path = &context.path;
+        unsigned int first = m_rollouts / m_threads + (0 < m_rollouts % m_threads ? 1 : 0);
+        for (unsigned int i = 1; i < m_threads && i < m_rollouts; i++) {
+            unsigned int share = m_rollouts / m_threads
+                + (i < m_rollouts % m_threads ? 1 : 0);
+            Agent *helper = m_leaf_agents[i - 1];
+            const ModelUndo *root = m_leaf_roots[i - 1];
+            reward_t *value = &values[first];
+            std::vector<value_sample_t> *samples = learned.empty() ? NULL : &learned[first];
+            rng_state_t seed = m_deterministic ? rngState() : splitRandom();
+            m_pool->submit([this, helper, root, path, value, samples, first, share,
+                    seed, stream, dfr]() {
+                rng_state_t saved = rngState();
+                rngState() = seed;
+                followPath(*helper, *path);
+                for (unsigned int r = 0; r < share; r++) {
+                    value[r] = leafPlayout(*helper, stream, first + r, dfr,
+                        samples != NULL ? &samples[r] : NULL);
+                }
+                helper->modelRevert(*root);
+                rngState() = saved;
+            });
+            first += share;
+        }
+        unsigned int share = m_rollouts / m_threads + (0 < m_rollouts % m_threads ? 1 : 0);
+        for (unsigned int r = 0; r < share; r++) {
+            values[r] = leafPlayout(agent, stream, r, dfr,
+                learned.empty() ? NULL : &learned[r]);
+        }
+        m_pool->wait();
+    } else {
+        for (unsigned int r = 0; r < m_rollouts; r++) {
+            values[r] = leafPlayout(agent, stream, r, dfr,
+                learned.empty() ? NULL : &learned[r]);
+        }
+    }
+
+    reward_t total = 0.0;
+    for (unsigned int r = 0; r < m_rollouts; r++) {
+        total += values[r];
+    }
+    for (size_t r = 0; r < learned.size(); r++) {
+        for (size_t i = 0; i < learned[r].size(); i++) {
+            learnValue(learned[r][i].first, learned[r][i].second);
+        }
+    }
+    return total / m_rollouts;
+}
+
+
+// Replay the actions and percepts of a path on an agent at the root. The
+// agent of a helper thread reverts lazily if the search does, so that it
+// only updates its model from where the path departs from the last one.
+void Searcher::followPath(Agent &agent, const std::vector<percept_t> &path) const {
+    for (size_t i = 0; i < path.size(); ) {
+        agent.modelUpdate((action_t) path[i]);
+        if (i + 2 < path.size()) agent.modelUpdate(path[i + 1], path[i + 2]);
+        i += 3;
+    }
+}
+
+
+// play out from a leaf, from the r'th stream of the simulation's in a
+// deterministic search
+reward_t Searcher::leafPlayout(Agent &agent, uint64_t stream, unsigned int r,
+        unsigned int dfr, std::vector<value_sample_t> *learned) const {
+    if (!m_deterministic) return playout(agent, dfr);
+
+    rng_state_t saved = rngState();
+    rngState() = randomState(randomKey(stream, r));
+    reward_t value = playout(agent, dfr, learned);
+    rngState() = saved;
+    return value;
+}
+
+
+// Run simulations from the agent's current state until the count of
+// simulations, which may be shared with other threads, reaches the time
+// limit, or in deadline mode until the deadline passes. Reading the
+// monotonic clock costs far less than a simulation, so the deadline is
+// checked before each one. The agent is left as it was found.
+void Searcher::growTree(SearchNode *tree, Agent &agent, SearchContext &context,
+		std::atomic<timelimit_t> &simulations, timelimit_t timelimit) const {
 
     //save agent's state
     ModelUndo undo = ModelUndo(agent);
+    if (m_lazy_revert) agent.beginLazyRevert();
 
-    SearchNode search_tree(false, agent.numActions());
+    // the key of this cycle's random streams, if deterministic
+    uint64_t cycle = m_deterministic ? randomKey(m_seed, agent.age()) : 0;
 
     //sample
-    for(visits_t i = 0; i < timelimit; ++i){    
-        search_tree.sample(agent, agent.horizon());
+    for (;;) {
+        if (m_stop.load(std::memory_order_relaxed)) break;
+        if (m_confident.load(std::memory_order_relaxed)) break;
+        if (m_early_stop && context.simulations > 0
+                && context.simulations % confidence_interval == 0
+                && confident(agent)) {
+            m_confident.store(true, std::memory_order_relaxed);
+            break;
+        }
+        if (m_deadline_ms > 0) {
+            if (std::chrono::steady_clock::now() >= m_deadline) break;
+        } else {
+            timelimit_t index = simulations.fetch_add(1, std::memory_order_relaxed);
+            if (index >= timelimit) break;
+            if (m_deterministic) {
+                context.stream = randomKey(cycle, index);
+                rngState() = randomState(context.stream);
+            }
+        }
+        tree->sample(agent, context, agent.horizon());
         agent.modelRevert(undo);
+        context.simulations++;
     }
-    
-    // Choose the action that has the highest expected reward.
-    // We assume timelimit is large enough so that every action was sampled.
-    // This is asserted in main::mainLoop().
-    double best_reward = search_tree.child(0)->expectation();
-    unsigned int best_action = 0;
-    for (unsigned int i = 1; i < agent.numActions(); ++i) {
-        if (search_tree.child(i)->expectation() > best_reward) {
-            best_reward = search_tree.child(i)->expectation();
-            best_action = i;
+    if (m_lazy_revert) agent.endLazyRevert();
+}
+
+
+// Combine the statistics of the root's children across the trees of the
+// current search, giving the visits and mean reward of each action
+void Searcher::rootStatistics(unsigned int num_actions,
+        std::vector<visits_t> &visits, std::vector<double> &means) const {
+    visits.assign(num_actions, 0);
+    means.assign(num_actions, 0.0);
+    for (unsigned int a = 0; a < num_actions; ++a) {
+        for (size_t i = 0; i < m_trees.size(); i++) {
+            SearchNode *child = m_trees[i]->child(a);
+            if (child == NULL || child->visits() == 0) continue;
+            visits_t n = child->visits();
+            if (visits[a] == 0) {
+                means[a] = child->expectation();
+            } else {
+                means[a] = (means[a] * visits[a] + child->expectation() * n)
+                    / (visits[a] + n);
+            }
+            visits[a] += n;
         }
     }
-    
-    return best_action;
 }
 
+
+// the simulations left to run in the current search, if it has a budget
+timelimit_t Searcher::remainingSimulations(void) const {
+    timelimit_t remaining = 0;
+    for (size_t i = 0; i < m_trees.size(); i++) {
+        timelimit_t count = m_counts[i].load(std::memory_order_relaxed);
+        if (count < m_limits[i]) remaining += m_limits[i] - count;
+    }
+    return remaining;
+}
+
+
+// True once the search can stop without changing the action it chooses.
+// Rewards lie in [0, R] for R the horizon times the maximum reward. The
+// choice certainly stands if even the remaining simulations all returning
+// 0 for the leading action and R for any other could not overtake it. It
+// stands with probability 1 - delta if the Hoeffding confidence interval of
+// the leader lies above the intervals of the other actions, with delta
+// shared out between the actions. Every action must have been sampled.
+bool Searcher::confident(const Agent &agent) const {
+    std::vector<visits_t> visits;
+    std::vector<double> means;
+    unsigned int num_actions = agent.numActions();
+    rootStatistics(num_actions, visits, means);
+
+    unsigned int leader = 0;
+    for (unsigned int a = 0; a < num_actions; a++) {
+        if (visits[a] == 0) return false;
+        if (means[a] > means[leader]) leader = a;
+    }
+    if (num_actions < 2) return true;
+
+    double range = agent.horizon() * agent.maxReward();
+    double log_term = log(2.0 * num_actions / m_early_stop_delta) / 2.0;
+    double remaining = m_deadline_ms > 0 ? -1.0 : (double) remainingSimulations();
+
+    bool settled = remaining >= 0.0;
+    bool separated = true;
+    double leader_low = means[leader] - range * sqrt(log_term / visits[leader]);
+    double leader_worst = means[leader] * visits[leader] / (visits[leader] + remaining);
+    for (unsigned int a = 0; a < num_actions && (settled || separated); a++) {
+        if (a == leader) continue;
+        double best = (means[a] * visits[a] + remaining * range) / (visits[a] + remaining);
+        if (best >= leader_worst) settled = false;
+        if (means[a] + range * sqrt(log_term / visits[a]) >= leader_low) separated = false;
+    }
+    return settled || separated;
+}
+
+
+// determine the best action by searching ahead using MCTS
+action_t Searcher::search(Agent &agent, timelimit_t timelimit) {
+
+    // Root parallel search grows a tree per thread and splits the
+    // simulations between them, tree parallel search shares one tree
+    // and one count of simulations between the threads, and leaf
+    // parallel search grows one tree on the calling thread.
+    unsigned int tree_threads = m_parallelism == LeafParallel ? 1 : m_threads;
+    if (m_deadline_ms == 0) {
+        // the simulations run while pondering count towards the budget
+        timelimit = m_pondered < timelimit ? timelimit - m_pondered : 0;
+    }
+    unsigned int num_trees = m_parallelism == RootParallel ? m_threads : 1;
+    std::vector<SearchNode *> &trees = m_trees;
+    trees.assign(num_trees, NULL);
+    m_searched = false;
+    m_confident.store(false);
+    for (unsigned int i = 0; i < num_trees && hasTranspositions(); i++) {
+        m_transpositions[i]->clear();
+    }
+    for (unsigned int i = 0; i < m_threads; i++) {
+        m_contexts[i]->arena.reset();
+        m_contexts[i]->simulations = 0;
+        m_contexts[i]->transpositions = hasTranspositions()
+            ? m_transpositions[num_trees == 1 ? 0 : i] : NULL;
+    }
+    m_deadline = std::chrono::steady_clock::now()
+        + std::chrono::milliseconds(m_deadline_ms);
+    m_nodes.store(m_kept_nodes);
+    for (unsigned int i = 0; i < num_trees; i++) {
+        trees[i] = m_roots[i];
+        if (trees[i] == NULL) {
+            trees[i] = SearchNode::create(m_contexts[i]->arena, false,
+                agent.numActions(), m_parallelism == TreeParallel && m_threads > 1);
+            addNode();
+        }
+        m_limits[i] = timelimit / num_trees + (i < timelimit % num_trees ? 1 : 0);
+        m_counts[i].store(0);
+    }
+
+    // a deterministic search leaves the calling thread's stream untouched
+    rng_state_t saved = rngState();
+    if (tree_threads == 1) {
+        // the helpers of a leaf parallel search keep their agents, which
+        // their models share with the caller's, for the whole search
+        for (unsigned int i = 1; i < m_threads && m_rollouts > 1; i++) {
+            Agent *helper = agent.fork();
+            m_leaf_agents.push_back(helper);
+            m_leaf_roots.push_back(new ModelUndo(*helper));
+            if (m_lazy_revert) helper->beginLazyRevert();
+        }
+        growTree(trees[0], agent, *m_contexts[0], m_counts[0], m_limits[0]);
+        if (m_deterministic) rngState() = saved;
+        for (size_t i = 0; i < m_leaf_agents.size(); i++) {
+            delete m_leaf_agents[i];
+            delete m_leaf_roots[i];
+        }
+        m_leaf_agents.clear();
+        m_leaf_roots.clear();
+    } else {
+        // every thread searches with its own fork of the agent and its
+        // own random stream
+        std::vector<Agent *> forks(m_threads, (Agent *) NULL);
+        std::vector<rng_state_t> seeds(m_threads);
+        for (unsigned int i = 1; i < m_threads; i++) {
+            forks[i] = agent.fork();
+            seeds[i] = splitRandom();
+        }
+        for (unsigned int i = 1; i < m_threads; i++) {
+            unsigned int t = num_trees == 1 ? 0 : i;
+            SearchNode *tree = trees[t];
+            Agent *fork = forks[i];
+            SearchContext *context = m_contexts[i];
+            std::atomic<timelimit_t> *count = &m_counts[t];
+            timelimit_t limit = m_limits[t];
+            rng_state_t seed = seeds[i];
+            m_pool->submit([this, tree, fork, context, count, limit, seed]() {
+                rng_state_t saved = rngState();
+                rngState() = seed;
+                growTree(tree, *fork, *context, *count, limit);
+                rngState() = saved;
+            });
+        }
+        growTree(trees[0], agent, *m_contexts[0], m_counts[0], m_limits[0]);
+        m_pool->wait();
+
+        for (unsigned int i = 1; i < m_threads; i++) {
+            delete forks[i];
+        }
+    }
+
+    // Choose the action that has the highest expected reward. Actions
+    // that were never sampled are not considered, unless none were.
+    std::vector<visits_t> visits;
+    std::vector<double> means;
+    rootStatistics(agent.numActions(), visits, means);
+    bool found = false;
+    double best_reward = 0.0;
+    unsigned int best_action = 0;
+    for (unsigned int a = 0; a < agent.numActions(); ++a) {
+        if (visits[a] > 0 && (!found || means[a] > best_reward)) {
+            found = true;
+            best_reward = means[a];
+            best_action = a;
+        }
+    }
+
+    // the trees may be kept for the next search
+    m_searched = true;
+
+    // the gap between the best two actions, none if fewer were sampled
+    double second_reward = best_reward;
+    bool second = false;
+    for (unsigned int a = 0; a < agent.numActions(); ++a) {
+        if (a == best_action || visits[a] == 0) continue;
+        if (!second || means[a] > second_reward) second_reward = means[a];
+        second = true;
+    }
+    double range = agent.horizon() * agent.maxReward();
+    m_value_gap = second && range > 0.0 ? (best_reward - second_reward) / range : 0.0;
+
+    m_simulations = 0;
+    for (unsigned int i = 0; i < m_threads; i++) {
+        m_simulations += m_contexts[i]->simulations;
+    }
+    m_saved = 0;
+    if (m_confident.load()) {
+        if (m_deadline_ms > 0) {
+            std::chrono::steady_clock::duration left =
+                m_deadline - std::chrono::steady_clock::now();
+            m_saved = std::max((long long) 0, (long long)
+                std::chrono::duration_cast<std::chrono::milliseconds>(left).count());
+        } else {
+            m_saved = remainingSimulations();
+        }
+    }
+    m_transposition_lookups = 0;
+    m_transposition_hits = 0;
+    for (size_t i = 0; i < m_transpositions.size(); i++) {
+        m_transposition_lookups += m_transpositions[i]->lookups();
+        m_transposition_hits += m_transpositions[i]->hits();
+    }
+
+    return found ? best_action : agent.genRandomAction();
+}
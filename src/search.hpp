@@ -2,49 +2,496 @@
 #define __SEARCH_HPP__
 
 #include "main.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <map>
+#include <stdint.h>
+#include <vector>
 
 class Agent;
-
-// determine the best action by searching ahead
-extern action_t search(Agent &agent, timelimit_t mc_timelimit);
+class ModelUndo;
+class Searcher;
+class SearchNode;
+class ThreadPool;
+class TranspositionTable;
 
 typedef unsigned long long visits_t;
 
-// contains information about a single "state"
+// Bump allocator holding the nodes of a search tree. Its blocks are kept
+// between searches, so that after the first few cycles a search allocates
+// no memory, and the whole tree is released in constant time by reset().
+class SearchArena {
+
+public:
+
+	SearchArena(size_t block_size = 1 << 16);
+
+	~SearchArena(void);
+
+	// allocate uninitialised storage for n objects of type T
+	template <typename T>
+	T *allocate(size_t n) { return static_cast<T *>(allocate(n * sizeof(T))); }
+
+	// release every allocation at once
+	void reset(void) { m_block = 0; m_offset = 0; }
+
+private:
+
+	// arenas are neither copied nor assigned
+	SearchArena(const SearchArena &other);
+	SearchArena &operator=(const SearchArena &other);
+
+	// allocate uninitialised, suitably aligned storage
+	void *allocate(size_t bytes);
+
+	size_t m_block_size;         // size of a regular block
+	std::vector<char *> m_blocks; // the blocks, in order of use
+	std::vector<size_t> m_sizes;  // the size of each block
+	size_t m_block;              // the block being allocated from
+	size_t m_offset;             // the next free byte of that block
+};
+
+// What a thread taking part in a search works with
+struct SearchContext {
+	SearchArena arena;   // where the thread allocates nodes
+	Searcher *searcher;  // the search the thread takes part in
+	visits_t simulations; // simulations run by the thread in this search
+	TranspositionTable *transpositions; // the table of its tree, or NULL
+	uint64_t stream;     // the key of the simulation's random stream, if
+	                     // the search is deterministic
+	std::vector<percept_t> path; // the actions and percepts (observation,
+	                     // then reward) from the root to the node sampled
+};
+
+// Decision nodes of a search tree keyed by the hash of the agent's model
+// context and the remaining horizon. Paths through the tree that reach the
+// same context share a node, and so its statistics. The table has a fixed
+// number of buckets of two entries each, and a node stored in a full bucket
+// replaces its less visited entry. The table only points into the tree, and
+// is cleared before each search.
+class TranspositionTable {
+
+public:
+
+	// a table of 2^bits entries, for bits from 2 to 32
+	TranspositionTable(unsigned int bits);
+
+	~TranspositionTable(void);
+
+	// forget every node and reset the counters
+	void clear(void);
+
+	// the node stored under a key, or NULL
+	SearchNode *find(uint64_t key);
+
+	// store a node under its key
+	void insert(SearchNode *node);
+
+	// number of lookups, successful lookups and replaced entries
+	visits_t lookups(void) const { return m_lookups.load(std::memory_order_relaxed); }
+	visits_t hits(void) const { return m_hits.load(std::memory_order_relaxed); }
+	visits_t replacements(void) const { return m_replacements.load(std::memory_order_relaxed); }
+
+private:
+
+	// tables are neither copied nor assigned
+	TranspositionTable(const TranspositionTable &other);
+	TranspositionTable &operator=(const TranspositionTable &other);
+
+	// the first entry of a key's bucket
+	std::atomic<SearchNode *> *bucket(uint64_t key) const {
+		return &m_entries[(key >> m_shift) * 2];
+	}
+
+	std::atomic<SearchNode *> *m_entries; // the buckets, two entries each
+	size_t m_size;                       // number of entries
+	unsigned int m_shift;                // shifts a key to its bucket
+	std::atomic<visits_t> m_lookups;
+	std::atomic<visits_t> m_hits;
+	std::atomic<visits_t> m_replacements;
+};
+
+// Monte Carlo tree search, as configured by the agent's options. Each
+// option is described with the member it sets. A search may run on several
+// threads, reuse the last tree, ponder while the environment acts, and be
+// bounded by simulations, a deadline or its number of nodes.
+class Searcher {
+
+public:
+
+	Searcher(options_t &options);
+
+	~Searcher(void);
+
+	// false, after reporting an error, if the search options conflict
+	static bool checkOptions(options_t &options);
+
+	// determine the best action by searching ahead using a number of
+	// simulations, leaving the agent as it was found
+	action_t search(Agent &agent, timelimit_t mc_timelimit);
+
+	// Move on to the agent's next cycle after it played an action and
+	// received a percept. The subtree of the last search reached by them
+	// becomes the root of the next search, if it is to be reused.
+	void advance(const Agent &agent, action_t action, percept_t observation,
+		percept_t reward);
+
+	// Search the most probable next percepts on background threads, after
+	// the agent played an action, until advance() is called.
+	void ponder(const Agent &agent, timelimit_t mc_timelimit);
+
+	// the mean reward of the playouts from a new leaf, up to 'dfr'
+	// cycles, leaving the agent as it was found
+	reward_t leafValue(Agent &agent, SearchContext &context, unsigned int dfr);
+
+	// the key of a percept in the children of a chance node
+	percept_t perceptKey(const Agent &agent, percept_t observation,
+		percept_t reward) const;
+
+	// true if a chance node with the given visits and children may
+	// sample a new percept
+	bool widen(visits_t visits, unsigned int children) const;
+
+	// true if the current search may add a node to its trees
+	bool mayExpand(void) const {
+		return m_max_nodes == 0 || m_nodes.load(std::memory_order_relaxed) < m_max_nodes;
+	}
+
+	// count a node added to the trees of the current search
+	void addNode(void) {
+		if (m_max_nodes > 0) m_nodes.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// true if searches have a limit on their nodes
+	bool limitsNodes(void) const { return m_max_nodes > 0; }
+
+	// number of nodes in the trees of the last search, if limited
+	visits_t nodes(void) const { return m_nodes.load(std::memory_order_relaxed); }
+
+	// true if chance nodes keep the probabilities of their percept bits
+	bool cachesPercepts(void) const { return m_percept_cache; }
+
+	// number of simulations run by the last search
+	visits_t simulations(void) const { return m_simulations; }
+
+	// true if searches run until a deadline rather than a number of
+	// simulations
+	bool hasDeadline(void) const { return m_deadline_ms > 0; }
+
+	// change the time allowed per search in deadline mode
+	void setDeadline(unsigned long long ms) { if (ms > 0 && hasDeadline()) m_deadline_ms = ms; }
+
+	// the difference between the values of the best two actions of the
+	// last search, relative to the largest possible value
+	double valueGap(void) const { return m_value_gap; }
+
+	// The part of its budget the last search saved by stopping early: a
+	// number of simulations, or of milliseconds with a deadline
+	visits_t saved(void) const { return m_saved; }
+
+	// true if searches may stop before using their whole budget
+	bool stopsEarly(void) const { return m_early_stop; }
+
+	// number of simulations of the last search that were run while
+	// pondering
+	visits_t pondered(void) const { return m_pondered; }
+
+	// true if the likely next percepts are searched while the environment
+	// acts
+	bool ponders(void) const { return m_ponder > 0; }
+
+	// the most threads a search or its pondering keeps busy, counting the
+	// calling thread
+	unsigned int threads(void) const { return std::max(m_threads, 1 + m_ponder); }
+
+	// true if decision nodes are shared through transposition tables
+	bool hasTranspositions(void) const { return !m_transpositions.empty(); }
+
+	// number of transposition table lookups, and of those that found a
+	// node, in the last search
+	visits_t transpositionLookups(void) const { return m_transposition_lookups; }
+	visits_t transpositionHits(void) const { return m_transposition_hits; }
+
+private:
+
+	// searchers are neither copied nor assigned
+	Searcher(const Searcher &other);
+	Searcher &operator=(const Searcher &other);
+
+	enum parallelism_t { RootParallel, TreeParallel, LeafParallel };
+
+	// stop pondering and wait for the speculative searches to end
+	void stopPondering(void);
+
+	// the visits and mean reward of each action, combined over the roots
+	// of the current search
+	void rootStatistics(unsigned int num_actions, std::vector<visits_t> &visits,
+		std::vector<double> &means) const;
+
+	// the simulations left to run in the current search
+	timelimit_t remainingSimulations(void) const;
+
+	// true once the current search can stop early, see confident() in
+	// search.cpp
+	bool confident(const Agent &agent) const;
+
+	// A rollout value learned by a playout: a context and the reward
+	// that followed it
+	typedef std::pair<uint64_t, reward_t> value_sample_t;
+
+	// the reward of a random playout of up to 'playout_len' cycles,
+	// leaving the agent as it was found. The rollout values it learns are
+	// added to 'learned' if given, and otherwise learned at once.
+	reward_t playout(Agent &agent, unsigned int playout_len,
+		std::vector<value_sample_t> *learned = NULL) const;
+
+	// the reward of the r'th playout from a leaf, see leafValue()
+	reward_t leafPlayout(Agent &agent, uint64_t stream, unsigned int r,
+		unsigned int dfr, std::vector<value_sample_t> *learned) const;
+
+	// update an agent at the root of the search along a path from it
+	void followPath(Agent &agent, const std::vector<percept_t> &path) const;
+
+	// add a reward seen in a playout to the mean reward after a context
+	void learnValue(uint64_t context, reward_t reward) const;
+
+	// set mean to the mean reward per cycle after a context, if known
+	void contextValue(uint64_t context, double &mean) const;
+
+	// run simulations into a tree on the calling thread
+	void growTree(SearchNode *tree, Agent &agent, SearchContext &context,
+		std::atomic<timelimit_t> &simulations, timelimit_t timelimit) const;
+
+	unsigned int m_threads;             // 'search-threads'
+
+	// 'search-parallelism': root parallel threads grow independent trees
+	// whose root statistics are summed, tree parallel threads share one
+	// tree, and leaf parallel threads share out the playouts of each new
+	// leaf of a tree grown by the caller
+	parallelism_t m_parallelism;
+	unsigned int m_rollouts;            // 'rollouts-per-leaf', averaged
+	ThreadPool *m_pool;                 // the threads helping the caller
+	std::vector<SearchContext *> m_contexts; // each thread's context
+
+	// Agents of the helper threads of a leaf parallel search, forked at
+	// the root for the whole search and taken along the path to each leaf
+	std::vector<Agent *> m_leaf_agents;
+	std::vector<ModelUndo *> m_leaf_roots; // their state at the root
+
+	// Search trees kept from one cycle to the next. The subtrees that are
+	// kept are copied between two sets of arenas, one per tree each, in
+	// turn. The other set holds the roots of the next search.
+	bool m_reuse;                       // 'search-reuse'
+	std::vector<SearchNode *> m_trees;  // the roots of the last search
+	bool m_searched;                    // true if m_trees are current
+	std::vector<SearchNode *> m_roots;  // the roots of the next search
+	std::vector<SearchArena *> m_keep[2]; // where the subtrees are kept
+	unsigned int m_side;                // the set holding m_roots
+
+	// 'search-deadline-ms': time allowed per search instead of
+	// 'mc-timelimit' simulations, if any
+	unsigned long long m_deadline_ms;
+	std::chrono::steady_clock::time_point m_deadline; // end of this search
+	visits_t m_simulations;             // simulations of the last search
+	std::vector<timelimit_t> m_limits;  // simulations allowed in each tree
+	std::vector< std::atomic<timelimit_t> > m_counts; // simulations started
+
+	// 'widening-c' and 'widening-alpha': if c is above zero, chance nodes
+	// only sample a new percept while they have fewer than c * visits^alpha
+	// children, and otherwise revisit one in proportion to its visits
+	double m_widening_c;
+	double m_widening_alpha;
+
+	// 'percept-abstraction': chance nodes branch on the 'full' percept,
+	// the 'reward' alone, or the reward and the observation bits of
+	// 'observation-mask' ('mask')
+	typedef percept_t (*abstraction_t)(percept_t observation, percept_t reward,
+		unsigned int obs_bits, percept_t mask);
+	abstraction_t m_abstraction;
+	percept_t m_observation_mask;       // observation bits kept by 'mask'
+
+	// 'transposition-bits': decision nodes reached by the same percept
+	// with the same model context and horizon are shared through a table
+	// of 2^bits entries per tree, if above zero
+	std::vector<TranspositionTable *> m_transpositions;
+	visits_t m_transposition_lookups;   // table statistics of the last search
+	visits_t m_transposition_hits;
+
+	// Speculative searches of the likely next percepts, each by a single
+	// threaded searcher with its own fork of the agent. The tree of the
+	// percept that arrives is kept and topped up to the next budget.
+	unsigned int m_ponder;              // 'ponder': percepts searched
+	std::vector<Searcher *> m_ponderers;
+	std::vector<Agent *> m_ponder_agents;
+	std::vector<percept_t> m_ponder_observations; // the percepts pondered
+	std::vector<percept_t> m_ponder_rewards;
+	ThreadPool *m_ponder_pool;          // the threads pondering
+	bool m_pondering;                   // true while pondering
+	std::atomic<bool> m_stop;           // set to end a speculative search
+	visits_t m_pondered;                // simulations kept from pondering
+
+	// 'early-stop': a search ends once its choice can no longer change,
+	// or is the best but with probability 'early-stop-delta'
+	bool m_early_stop;
+	double m_early_stop_delta;
+	mutable std::atomic<bool> m_confident; // set once the search may stop
+	visits_t m_saved;                   // budget saved by the last search
+	double m_value_gap;                 // see valueGap()
+	bool m_lazy_revert;                 // 'lazy-revert', see Agent::beginLazyRevert()
+
+	// 'percept-cache': chance nodes keep the probabilities of the percept
+	// bits of their model state to draw later percepts from; only with
+	// the full percept abstraction and no transposition table
+	bool m_percept_cache;
+
+	// The mean reward per cycle after each context of the rollout model,
+	// learned by truncated playouts. Contexts share a fixed number of
+	// entries by their hash.
+	struct ValueEntry {
+		std::atomic<uint64_t> key;      // the hash of the context
+		std::atomic<double> mean;
+		std::atomic<visits_t> count;    // rewards seen, 0 if the entry is empty
+	};
+	unsigned int m_rollout_length;      // 'rollout-length', 0 for the horizon
+	ValueEntry *m_values;               // the rollout values, if truncating
+	unsigned int m_value_shift;         // shifts a hash to its entry
+
+	// 'search-max-nodes': nodes allowed per search, counting those kept,
+	// if above zero. Past it, nodes needing a new child play out instead.
+	visits_t m_max_nodes;
+	std::atomic<visits_t> m_nodes;      // nodes in the trees of this search
+	visits_t m_kept_nodes;              // nodes kept in m_roots
+
+	// 'search-deterministic': every simulation, and each playout of a
+	// leaf, draws from its own random stream keyed by the seed, the age
+	// and its index, so the choices do not depend on the threads. Such a
+	// search is leaf parallel, and neither ponders nor has a deadline.
+	bool m_deterministic;
+	uint64_t m_seed;                    // the key of its random streams
+};
+
+// contains information about a single "state". Nodes may be shared by
+// several search threads: their statistics are then updated atomically,
+// and children are always inserted without locks.
 class SearchNode {
 
 public:
 
-	SearchNode(bool is_chance_node, unsigned int num_actions);
-    
-    ~SearchNode();
-    
+	// construct a node in the arena, of a tree that may be shared by
+	// several threads
+	static SearchNode *create(SearchArena &arena, bool is_chance_node,
+		unsigned int num_actions, bool shared);
+
 	// determine the next action to play
-	action_t selectAction(Agent &agent, unsigned int dfr); 
+	action_t selectAction(Agent &agent, SearchContext &context, unsigned int dfr);
 
 	// determine the expected reward from this node
-	reward_t expectation(void) const { return m_mean; }
+	reward_t expectation(void) const { return m_mean.load(std::memory_order_relaxed); }
 
 	// perform a sample run through this node and it's children,
 	// returning the accumulated reward from this sample run
-	reward_t sample(Agent &agent, unsigned int dfr); 
+	reward_t sample(Agent &agent, SearchContext &context, unsigned int dfr);
 
 	// number of times the search node has been visited
-	visits_t visits(void) const { return m_visits; }
-	
-	SearchNode* child(unsigned int n) { return m_child[n]; }
+	visits_t visits(void) const { return m_visits.load(std::memory_order_relaxed); }
+
+	// the chance node reached by playing an action from this decision node
+	SearchNode *child(action_t action) const {
+		return m_child[action].load(std::memory_order_acquire);
+	}
+
+	// the decision node reached by a percept from this chance node, or
+	// NULL if the percept has not been seen
+	SearchNode *findPercept(percept_t percept) const;
+
+	// the transposition key of a decision node
+	uint64_t key(void) const { return m_key; }
+
+	// number of nodes in the subtree below this node, counting nodes
+	// shared by several parents once per parent
+	visits_t size(unsigned int num_actions) const;
+
+	// Copy the subtree below this node into an arena. Nodes shared by
+	// several parents are copied once if the copies made so far are
+	// tracked in 'copies'.
+	SearchNode *copy(SearchArena &arena, unsigned int num_actions,
+		bool shared, std::map<const SearchNode *, SearchNode *> *copies) const;
 
 private:
 
+	// A segment of a chance node's open-addressing table of children,
+	// keyed by percept. Segments are chained as they fill up.
+	struct PerceptTable {
+		unsigned int capacity;             // number of slots, a power of two
+		std::atomic<percept_t> *keys;      // the percept of each slot
+		std::atomic<SearchNode *> *child;  // the node of each slot
+		std::atomic<PerceptTable *> next;  // the next, larger, segment
+	};
+
+	// A node of a chance node's binary tree of percept prefixes, holding
+	// the probability that the bit following the prefix is a 0
+	struct PerceptBit {
+		double prob_zero;
+		std::atomic<PerceptBit *> child[2]; // the longer prefixes
+	};
+
+	// walks the percept prefixes of a chance node, see search.cpp
+	class BitCursor;
+
+	// nodes live in an arena and are never copied
+	SearchNode(bool is_chance_node, bool shared);
+	SearchNode(const SearchNode &other);
+	SearchNode &operator=(const SearchNode &other);
+
+	// construct an empty percept table segment in the arena
+	static PerceptTable *createTable(SearchArena &arena, unsigned int capacity);
+
+	// the slot of a percept in this chance node's table, claimed for the
+	// caller to fill in if the percept has not been seen before
+	std::atomic<SearchNode *> *claimPercept(SearchArena &arena,
+		percept_t percept, bool &claimed);
+
+	// the decision node reached by a percept from this chance node, with
+	// 'dfr' cycles left, created or found in the transposition table if
+	// the percept has not been seen before
+	SearchNode *perceptChild(Agent &agent, SearchContext &context,
+		percept_t percept, percept_t observation, percept_t reward,
+		unsigned int dfr);
+
+	// a child of this chance node, chosen in proportion to its visits
+	SearchNode *revisitChild(void) const;
+
+	// true if this decision node has actions that have not been explored
+	bool hasUnexplored(void) const;
+
 	bool m_chance_node; // true if this node is a chance node, false otherwise
-	double m_mean;      // the expected reward of this node
-	visits_t m_visits;  // number of times the search node has been visited
+	bool m_shared;      // true if the node's tree is shared by threads
+	std::atomic<double> m_mean;      // the expected reward of this node
+	std::atomic<visits_t> m_visits;  // number of times the search node has been visited
+	std::atomic<unsigned int> m_virtual_loss; // threads sampling below this node
+	std::atomic<double> m_log_visits; // log(m_visits), used by the UCB of every child
+
+	// Decision nodes remember the percept that first reached them, and
+	// their transposition key
+	percept_t m_observation;
+	percept_t m_reward;
+	uint64_t m_key;
+
+	// Decision nodes index their children by action, and keep a bit
+	// per action that has not been explored yet.
+	unsigned int m_words;                  // number of unexplored action words
+	std::atomic<SearchNode *> *m_child;
+	std::atomic<uint64_t> *m_unexplored;
+
+	// Chance nodes keep their children in a table keyed by percept.
+	PerceptTable *m_percepts;
+	std::atomic<unsigned int> m_children; // number of percepts in the table
 
-	// TODO: decide how to reference child nodes
-	//  e.g. a fixed-size array
-	std::map<unsigned int, SearchNode*> m_child;
-    std::vector<action_t> m_unexplored_actions;
+	// Chance nodes may also keep the probabilities of the percept bits
+	// sampled from them, which the model state at the node fixes.
+	std::atomic<PerceptBit *> m_bits;
 };
 
 
@@ -0,0 +1,223 @@
+#include "session.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+
+#include "agent.hpp"
+#include "environment.hpp"
+#include "util.hpp"
+
+
+// set up the agent/environment interaction loop
+Session::Session(options_t &options, Agent *agent, Environment *env,
+		std::ostream *progress) :
+	m_options(options),
+	m_agent(agent),
+	m_env(env),
+	m_progress(progress),
+	m_searcher(options),
+	m_budget(options, m_searcher.hasDeadline()),
+	m_last_budget(0),
+	m_last_action(0),
+	m_cycle(1),
+	m_finished(false)
+{
+	// Set up logging
+	std::string log_file = m_options["log"];
+	m_verbose_log.open((log_file + ".log").c_str());
+	m_compact_log.open((log_file + ".csv").c_str());
+
+	// Print header to compactLog
+	m_compact_log << "cycle, observation, reward, action, explored, explore_rate, total reward, average reward, budget" << std::endl;
+
+	// Determine exploration options
+	m_explore = m_options.count("exploration") > 0;
+	m_explore_rate = 0.0;
+	m_explore_decay = 1.0;
+	if (m_explore) {
+		strExtract(m_options["exploration"], m_explore_rate);
+		strExtract(m_options["explore-decay"], m_explore_decay);
+		assert(0.0 <= m_explore_rate && m_explore_rate <= 1.0);
+		assert(0.0 <= m_explore_decay && m_explore_decay <= 1.0);
+	}
+
+	// Determine termination age
+	m_terminate_check = m_options.count("terminate-age") > 0;
+	m_terminate_age = 0;
+	if (m_terminate_check) {
+		strExtract(m_options["terminate-age"], m_terminate_age);
+	}
+
+	// Determine mc-timelimit
+	strExtract(m_options["mc-timelimit"], m_mc_timelimit);
+	//if we assume that time_limit > agent.numActions() we can be sure
+	//that every action is selected at least once
+	if (m_mc_timelimit < m_agent->numActions() && !m_searcher.hasDeadline()) {
+		std::cerr << "WARNING: time_limit not large enough to sample all actions" << std::endl;
+	}
+
+	// Determine whether to write cts during the process, or only at the end.
+	m_intermediate_ct = true;
+	if (m_options.count("intermediate-ct") > 0) {
+		m_intermediate_ct = !(m_options["intermediate-ct"] == "0");
+	}
+}
+
+
+Session::~Session(void) {
+	m_verbose_log.close();
+	m_compact_log.close();
+
+	delete m_agent;
+	delete m_env;
+}
+
+
+// Run one cycle of the agent/environment interaction loop
+bool Session::step(void) {
+	Agent &ai = *m_agent;
+	Environment &env = *m_env;
+
+	if (m_finished || env.isFinished()) {
+		m_finished = true;
+		return false;
+	}
+
+	// check for agent termination
+	if (m_terminate_check && ai.age() >= m_terminate_age) {
+		m_verbose_log << "info: terminating agent" << std::endl;
+		m_finished = true;
+		return false;
+	}
+
+	unsigned int cycle = m_cycle++;
+
+	// Get a percept from the environment
+	percept_t observation = env.getObservation();
+	percept_t reward = env.getReward();
+
+	// Tell the budget manager how hard the last decision was, judging by
+	// the search and how well the model predicted the percept
+	if (m_budget.enabled() && m_last_budget > 0) {
+		double bits = ai.numObsBits() + ai.numRewBits();
+		double surprise = -log2(ai.perceptProbability(observation, reward)) / bits;
+		timelimit_t saved = std::min<timelimit_t>(m_searcher.saved(), m_last_budget);
+		m_budget.record(m_searcher.valueGap(), std::min(surprise, 1.0),
+			m_last_budget - saved);
+	}
+
+	// Update agent's environment model with the new percept
+	ai.modelUpdate(observation, reward);
+	if (cycle > 1) m_searcher.advance(ai, m_last_action, observation, reward);
+
+	// Determine best exploitive action, or explore
+	action_t action;
+	bool explored = false;
+	timelimit_t budget = 0;
+	if (m_explore && rand01() < m_explore_rate) {
+		explored = true;
+		action = ai.genRandomAction();
+	}
+	else {
+		budget = m_budget.allocate();
+		if (m_searcher.hasDeadline()) {
+			m_searcher.setDeadline(budget > 0 ? budget : 1);
+			action = m_searcher.search(ai, m_mc_timelimit);
+		} else {
+			action = m_searcher.search(ai, budget);
+		}
+	}
+	m_last_budget = budget;
+
+	// Update agent's environment model with the chosen action
+	ai.modelUpdate(action);
+	m_last_action = action;
+
+	// Send an action to the environment, searching the likely next
+	// percepts in the meantime
+	m_searcher.ponder(ai, m_mc_timelimit);
+	env.performAction(action);
+
+	// Log this turn
+	m_verbose_log << "cycle: " << cycle << std::endl;
+	m_verbose_log << "observation: " << observation << std::endl;
+	m_verbose_log << "reward: " << reward << std::endl;
+	m_verbose_log << "action: " << action << std::endl;
+	m_verbose_log << "explored: " << (explored ? "yes" : "no") << std::endl;
+	if (!explored) {
+		m_verbose_log << "simulations: " << m_searcher.simulations() << std::endl;
+		if (m_searcher.stopsEarly()) {
+			m_verbose_log << (m_searcher.hasDeadline() ? "milliseconds saved: "
+				: "simulations saved: ") << m_searcher.saved() << std::endl;
+		}
+		if (m_searcher.ponders()) {
+			m_verbose_log << "pondered simulations: " << m_searcher.pondered() << std::endl;
+		}
+		if (m_searcher.limitsNodes()) {
+			m_verbose_log << "search nodes: " << m_searcher.nodes() << std::endl;
+		}
+		if (m_searcher.hasTranspositions()) {
+			m_verbose_log << "transposition hits: " << m_searcher.transpositionHits()
+				<< "/" << m_searcher.transpositionLookups() << std::endl;
+		}
+	}
+	m_verbose_log << "explore rate: " << m_explore_rate << std::endl;
+	m_verbose_log << "total reward: " << ai.reward() << std::endl;
+	m_verbose_log << "average reward: " << ai.averageReward() << std::endl;
+
+	// Log the data in a more compact form
+	m_compact_log << cycle << ", " << observation << ", " << reward << ", "
+			<< action << ", " << explored << ", " << m_explore_rate << ", "
+			<< ai.reward() << ", " << ai.averageReward() << ", "
+			<< budget << std::endl;
+
+	// Print to standard output when cycle == 2^n
+	if ((cycle & (cycle - 1)) == 0) {
+		if (m_progress) {
+			*m_progress << "cycle: " << cycle << std::endl;
+			*m_progress << "average reward: " << ai.averageReward() << std::endl;
+			if (m_explore) {
+				*m_progress << "explore rate: " << m_explore_rate << std::endl;
+			}
+		}
+
+		// Write context tree file
+		if (m_options["write-ct"] != "" && m_intermediate_ct) {
+			// write a ct for each 2^n cycles.
+			writeModel(cycle);
+		}
+	}
+
+	// Update exploration rate
+	if (m_explore) m_explore_rate *= m_explore_decay;
+
+	return true;
+}
+
+
+// Print a summary and write the final context tree
+void Session::finish(void) {
+	if (m_progress) {
+		*m_progress << std::endl << std::endl << "SUMMARY" << std::endl;
+		*m_progress << "agent age: " << m_agent->age() << std::endl;
+		*m_progress << "average reward: " << m_agent->averageReward() << std::endl;
+	}
+
+	// Write context tree file
+	if (m_options["write-ct"] != "") {
+		// write a ct for the final cycle too.
+		writeModel(m_agent->age());
+	}
+}
+
+
+// write the agent's model to a file suffixed with the given age
+void Session::writeModel(unsigned long long age) {
+	char age_string[256];
+	sprintf(age_string, "%llu", age);
+	std::ofstream ct((m_options["write-ct"] + std::string(age_string) + ".ct").c_str());
+	m_agent->writeModel(ct);
+	ct.close();
+}
@@ -0,0 +1,91 @@
+#ifndef __SESSION_HPP__
+#define __SESSION_HPP__
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "budget.hpp"
+#include "main.hpp"
+#include "search.hpp"
+
+class Agent;
+class Environment;
+
+// An agent interacting with its environment: the state of the
+// agent/environment interaction loop together with its logs
+class Session {
+
+public:
+
+	// set up the interaction loop between an agent and its environment as
+	// configured by the options, taking ownership of both. Progress is
+	// printed to 'progress' if it is not NULL.
+	Session(options_t &options, Agent *agent, Environment *env,
+		std::ostream *progress);
+
+	// close the logs and destroy the agent and environment
+	~Session(void);
+
+	// run a single agent/environment interaction cycle, returning false
+	// once the interaction has finished
+	bool step(void);
+
+	// print a summary and write the final context tree
+	void finish(void);
+
+	// true once the interaction has finished
+	bool finished(void) const { return m_finished; }
+
+	// number of completed interaction cycles
+	unsigned int cycles(void) const { return m_cycle - 1; }
+
+	// the interacting agent
+	const Agent &agent(void) const { return *m_agent; }
+
+	// the agent's searcher
+	const Searcher &searcher(void) const { return m_searcher; }
+
+private:
+
+	// sessions are neither copied nor assigned
+	Session(const Session &other);
+	Session &operator=(const Session &other);
+
+	// write the agent's model to a file suffixed with the given age
+	void writeModel(unsigned long long age);
+
+	options_t m_options;
+	Agent *m_agent;
+	Environment *m_env;
+	std::ostream *m_progress;
+
+	// Streams for logging
+	std::ofstream m_verbose_log; // A verbose human-readable log
+	std::ofstream m_compact_log; // A compact comma-separated value log
+
+	// exploration options
+	bool m_explore;
+	double m_explore_rate;
+	double m_explore_decay;
+
+	// termination age
+	bool m_terminate_check;
+	age_t m_terminate_age;
+
+	// number of mc simulations per search
+	timelimit_t m_mc_timelimit;
+	Searcher m_searcher;
+	BudgetManager m_budget;    // declared after m_searcher, whose deadline it reads
+	timelimit_t m_last_budget; // the budget of the last search, 0 if none
+
+	// whether to write cts during the process, or only at the end
+	bool m_intermediate_ct;
+
+	action_t m_last_action; // the action of the last cycle
+	unsigned int m_cycle; // the next interaction cycle
+	bool m_finished;      // true once the interaction has finished
+};
+
+
+#endif // __SESSION_HPP__
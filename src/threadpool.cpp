@@ -0,0 +1,70 @@
+#include "threadpool.hpp"
+
+
+// start a pool of worker threads
+ThreadPool::ThreadPool(unsigned int threads) :
+	m_pending(0),
+	m_stop(false)
+{
+	if (threads == 0) threads = 1;
+	for (unsigned int i = 0; i < threads; i++) {
+		m_workers.push_back(std::thread(&ThreadPool::work, this));
+	}
+}
+
+
+// wait for all queued tasks, then stop and join the workers
+ThreadPool::~ThreadPool(void) {
+	wait();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_task_ready.notify_all();
+	for (size_t i = 0; i < m_workers.size(); i++) {
+		m_workers[i].join();
+	}
+}
+
+
+// queue a task for execution
+void ThreadPool::submit(const std::function<void(void)> &task) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_tasks.push_back(task);
+		++m_pending;
+	}
+	m_task_ready.notify_one();
+}
+
+
+// block until every submitted task has completed
+void ThreadPool::wait(void) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_pending > 0) {
+		m_idle.wait(lock);
+	}
+}
+
+
+// take tasks off the queue and run them until the pool is stopped
+void ThreadPool::work(void) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;) {
+		while (m_tasks.empty() && !m_stop) {
+			m_task_ready.wait(lock);
+		}
+		if (m_tasks.empty()) return;
+
+		std::function<void(void)> task = m_tasks.front();
+		m_tasks.pop_front();
+
+		lock.unlock();
+		task();
+		lock.lock();
+
+		if (--m_pending == 0) {
+			m_idle.notify_all();
+		}
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef __THREADPOOL_HPP__
+#define __THREADPOOL_HPP__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed-size pool of worker threads executing queued tasks in FIFO order
+class ThreadPool {
+
+public:
+
+	// start a pool of the given number of worker threads (at least one)
+	ThreadPool(unsigned int threads);
+
+	// wait for all queued tasks to complete and stop the workers
+	~ThreadPool(void);
+
+	// queue a task for execution by the next idle worker. Tasks may submit
+	// further tasks.
+	void submit(const std::function<void(void)> &task);
+
+	// block until every submitted task has completed
+	void wait(void);
+
+	// number of worker threads
+	unsigned int size(void) const { return m_workers.size(); }
+
+private:
+
+	// pools are neither copied nor assigned
+	ThreadPool(const ThreadPool &other);
+	ThreadPool &operator=(const ThreadPool &other);
+
+	// worker thread main loop
+	void work(void);
+
+	std::vector<std::thread> m_workers;
+	std::deque< std::function<void(void)> > m_tasks;
+
+	std::mutex m_mutex;
+	std::condition_variable m_task_ready; // signalled when a task is queued
+	std::condition_variable m_idle;       // signalled when all tasks are done
+
+	unsigned int m_pending; // tasks queued or running
+	bool m_stop;            // true once the workers should exit
+};
+
+
+#endif // __THREADPOOL_HPP__
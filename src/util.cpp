@@ -1,23 +1,116 @@
 #include "util.hpp"
 
+#include <atomic>
 #include <cassert>
-#include <cstdlib>
 
 
-// Return a random number uniformly distributed in [0, 1]
+// The next value of a splitmix64 sequence, used to expand seeds
+static inline uint64_t splitmix64(uint64_t &x) {
+	uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+// The next output of a xoshiro256** generator
+static inline uint64_t next(rng_state_t &state) {
+	uint64_t *s = state.s;
+	const uint64_t result = rotl(s[1] * 5, 7) * 9;
+	const uint64_t t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return result;
+}
+
+// a double in [0, 1) from the top 53 bits of a random number
+static inline double toUnit(uint64_t x) {
+	return (x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+// The splitmix64 sequence the threads' generators are first seeded from,
+// so that no two threads start from the same stream
+static std::atomic<uint64_t> thread_seeds(0);
+
+// A generator state for a new thread, from the next seed of the sequence
+static rng_state_t threadState(void) {
+	uint64_t x = thread_seeds.fetch_add(0x9E3779B97F4A7C15ULL, std::memory_order_relaxed);
+	return randomState(splitmix64(x));
+}
+
+// The calling thread's generator state
+rng_state_t &rngState(void) {
+	static thread_local rng_state_t state = threadState();
+	return state;
+}
+
+// A generator state seeded from a number. The state is never all zero.
+rng_state_t randomState(uint64_t seed) {
+	rng_state_t state;
+	for (unsigned int i = 0; i < 4; i++) {
+		state.s[i] = splitmix64(seed);
+	}
+	return state;
+}
+
+// Seed the calling thread's generator
+void seedRandom(uint64_t seed) {
+	rngState() = randomState(seed);
+}
+
+// Split a new stream off the calling thread's, seeded by its next number
+rng_state_t splitRandom(void) {
+	return randomState(next(rngState()));
+}
+
+// The key of a substream, mixing the counter into the key
+uint64_t randomKey(uint64_t key, uint64_t counter) {
+	uint64_t x = key ^ (counter * 0xD1B54A32D192ED03ULL);
+	return splitmix64(x);
+}
+
+// Return a random 64 bit integer
+uint64_t rand64(void) {
+	return next(rngState());
+}
+
+// Return a random number uniformly distributed in [0, 1)
 double rand01() {
-	return (double)rand() / (double)RAND_MAX;
+	return toUnit(next(rngState()));
 }
 
-// Return a random integer between [0, end)
-unsigned int randRange(unsigned int end) {
-	assert(end <= RAND_MAX);
+// Fill an array with random numbers uniformly distributed in [0, 1)
+void rand01(double *values, size_t n) {
+	rng_state_t &state = rngState();
+	for (size_t i = 0; i < n; i++) {
+		values[i] = toUnit(next(state));
+	}
+}
 
-	// Generate an integer between [0, end) uniformly
-	int r = rand();
-	const int remainder = RAND_MAX % end;
-	while (r < remainder) r = rand();
-	return r % end;
+// Return a random integer between [0, end), by Lemire's multiply and
+// shift, rejecting the few low products that would bias the result
+unsigned int randRange(unsigned int end) {
+	assert(end > 0);
+
+	rng_state_t &state = rngState();
+	uint64_t m = (next(state) >> 32) * end;
+	uint32_t low = (uint32_t) m;
+	if (low < end) {
+		const uint32_t threshold = -end % end;
+		while (low < threshold) {
+			m = (next(state) >> 32) * end;
+			low = (uint32_t) m;
+		}
+	}
+	return m >> 32;
 }
 
 // Return a random number between [start, end)
@@ -51,6 +144,16 @@ void encode(symbol_list_t &symlist, unsigned int value, unsigned int bits) {
 }
 
 
+// Number of bits needed to represent the values [0, n)
+unsigned int bitsRequired(unsigned int n) {
+	unsigned int bits = 0;
+	for (unsigned int i = 1; i < n; i *= 2) {
+		bits++;
+	}
+	return bits;
+}
+
+
 // Convert a boolean array into an (unsigned) int
 unsigned int boolToInt(bool *array, int size) {
     unsigned int mask = 1;
@@ -3,14 +3,49 @@
 
 #include <fstream>
 #include <iostream>
+#include <stdint.h>
 #include <sstream>
 #include <string>
 
 #include "main.hpp"
 
-// Return a number uniformly between [0, 1]
+// State of a random number generator, a xoshiro256** generator. Every
+// thread draws from its own generator, so threads neither contend for nor
+// share a random stream. Each thread's generator starts from its own seed
+// until it is seeded or swapped.
+struct rng_state_t {
+	uint64_t s[4];
+};
+
+// The calling thread's generator state, which may be saved and swapped to
+// give an agent its own random stream regardless of the thread running it
+rng_state_t &rngState(void);
+
+// A generator state seeded from a number
+rng_state_t randomState(uint64_t seed);
+
+// Seed the calling thread's generator
+void seedRandom(uint64_t seed);
+
+// Split a new stream off the calling thread's, for another thread to draw
+// from. Streams split in the same order from the same state are the same.
+rng_state_t splitRandom(void);
+
+// The key of a substream, derived from the key of a stream and a counter.
+// Keys derived from different counters give independent streams through
+// randomState(), so the stream for any (seed, counter, ...) tuple can be
+// set up directly, without drawing from the streams before it.
+uint64_t randomKey(uint64_t key, uint64_t counter);
+
+// Return a random 64 bit integer
+uint64_t rand64(void);
+
+// Return a number uniformly in [0, 1)
 double rand01();
 
+// Fill an array with numbers uniformly in [0, 1)
+void rand01(double *values, size_t n);
+
 // Return a random integer between [0, end)
 unsigned int randRange(unsigned int end);
 
@@ -36,6 +71,9 @@ unsigned int decode(const symbol_list_t &symlist, unsigned int bits);
 void encode(symbol_list_t &symlist, unsigned int value, unsigned int bits);
 
 
+// Number of bits needed to represent the values [0, n)
+unsigned int bitsRequired(unsigned int n);
+
 // Convert a boolean array into an (unsigned) int
 unsigned int boolToInt(bool *array, int size);
 